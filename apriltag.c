@@ -31,6 +31,7 @@ either expressed or implied, of the Regents of The University of Michigan.
 */
 
 #include "apriltag.h"
+#include "apriltag_tasks.h"
 
 #define _USE_MATH_DEFINES
 #include <math.h>
@@ -39,6 +40,9 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #include "common/image_u8.h"
 #include "common/image_u8_parallel.h"
@@ -50,6 +54,8 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include "common/math_util.h"
 #include "common/g2d.h"
 #include "common/debug_print.h"
+#include "common/simd.h"
+#include "common/file_map.h"
 
 #include "apriltag_math.h"
 
@@ -70,6 +76,8 @@ static inline long int random(void)
 #define APRILTAG_U64_ONE ((uint64_t) 1)
 
 extern zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im);
+extern image_u8_t *apriltag_workspace_decimate(apriltag_detector_t *td, image_u8_t *im, float factor);
+extern void apriltag_workspace_destroy(struct apriltag_workspace *ws);
 
 // Regresses a model of the form:
 // intensity(x,y) = C0*x + C1*y + CC2
@@ -142,27 +150,6 @@ static uint64_t rotate90(uint64_t w, int numBits)
     return w;
 }
 
-static void quad_destroy(struct quad *quad)
-{
-    if (!quad)
-        return;
-
-    matd_destroy(quad->H);
-    matd_destroy(quad->Hinv);
-    free(quad);
-}
-
-static struct quad *quad_copy(struct quad *quad)
-{
-    struct quad *q = calloc(1, sizeof(struct quad));
-    memcpy(q, quad, sizeof(struct quad));
-    if (quad->H)
-        q->H = matd_copy(quad->H);
-    if (quad->Hinv)
-        q->Hinv = matd_copy(quad->Hinv);
-    return q;
-}
-
 struct quick_decode_result
 {
     uint64_t rcode;   // the queried code
@@ -173,9 +160,15 @@ struct quick_decode_result
 
 #define NUM_CHUNKS 4
 
-struct quick_decode
+// The chunk tables of a family: for each chunk of the code bits, the
+// codes grouped by the value of that chunk. They are kept in a single
+// block, laid out as in the files written by
+// apriltag_family_write_decode_tables: a quick_decode_header, then the
+// chunk_offsets of all chunks, then their chunk_ids.
+struct quick_decode_tables
 {
     int nbits;
+    int ncodes;
     int chunk_size;
     int capacity;
     int chunk_mask;
@@ -183,147 +176,335 @@ struct quick_decode
 
     // chunk_offsets is a map from chunk value to a range of locations in chunk_ids.
     // Together with chunk_ids, this allows a lookup of all codes matching a chunk value.
-    uint16_t* chunk_offsets[NUM_CHUNKS];
+    const uint16_t *chunk_offsets[NUM_CHUNKS];
 
     // chunk_ids is an array of indices into the codes table
-    uint16_t* chunk_ids[NUM_CHUNKS];
+    const uint16_t *chunk_ids[NUM_CHUNKS];
 
-    int maxhamming;
-    int ncodes;
+    const void *data;
+    size_t size;
+    file_map_t *fm; // non-NULL if data is mapped from a file
 };
 
-static void quick_decode_uninit(apriltag_family_t *fam)
+#define QUICK_DECODE_MAGIC "atqdtbl1"
+
+struct quick_decode_header
 {
-    if (!fam->impl)
-        return;
+    char magic[8];
+    uint32_t nbits;
+    uint32_t ncodes;
+    uint32_t chunk_size;
+    uint32_t reserved;
+    uint64_t checksum; // of the family's codes, see quick_decode_checksum
+};
+
+// What a family's impl points to, shared by all the detectors the
+// family is added to. Those may correct different numbers of bits:
+// the tables do not depend on it. refcount is only changed by adding
+// and removing the family, which must not happen concurrently. tables
+// is built (or mapped) when the family is first added, or, if that
+// failed, by the next detection, and so can be published by several
+// detectors at the same time.
+struct quick_decode
+{
+    int refcount;
+    struct quick_decode_tables *tables;
+};
+
+#if !defined(__GNUC__) && !defined(__clang__) && !defined(_MSC_VER)
+// Without the compiler's atomic builtins, tables are loaded and
+// published under this lock instead.
+static pthread_mutex_t quick_decode_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static inline struct quick_decode_tables *quick_decode_load_tables(struct quick_decode_tables **p)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#elif defined(_MSC_VER)
+    return (struct quick_decode_tables*) _InterlockedCompareExchangePointer((void* volatile*) p, NULL, NULL);
+#else
+    pthread_mutex_lock(&quick_decode_mutex);
+    struct quick_decode_tables *tables = *p;
+    pthread_mutex_unlock(&quick_decode_mutex);
+    return tables;
+#endif
+}
+
+// Sets *p to tables if it is still NULL. Returns the tables *p
+// points to afterwards.
+static inline struct quick_decode_tables *quick_decode_publish_tables(struct quick_decode_tables **p,
+                                                                     struct quick_decode_tables *tables)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    struct quick_decode_tables *expected = NULL;
+    if (__atomic_compare_exchange_n(p, &expected, tables, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return tables;
+    return expected;
+#elif defined(_MSC_VER)
+    struct quick_decode_tables *old = (struct quick_decode_tables*)
+        _InterlockedCompareExchangePointer((void* volatile*) p, tables, NULL);
+    return old ? old : tables;
+#else
+    pthread_mutex_lock(&quick_decode_mutex);
+    if (*p == NULL)
+        *p = tables;
+    else
+        tables = *p;
+    pthread_mutex_unlock(&quick_decode_mutex);
+    return tables;
+#endif
+}
+
+// FNV-1a, identifies the codes the tables were built for.
+static uint64_t quick_decode_checksum(const apriltag_family_t *family)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (uint32_t i = 0; i < family->ncodes; i++) {
+        for (int j = 0; j < 64; j += 8) {
+            h ^= (family->codes[i] >> j) & 0xff;
+            h *= 0x100000001b3ULL;
+        }
+    }
+    return h;
+}
+
+// fills in the layout of the family's tables, returning the size of
+// their block.
+static size_t quick_decode_tables_layout(struct quick_decode_tables *qt, const apriltag_family_t *family)
+{
+    qt->ncodes = family->ncodes;
+    qt->nbits = family->nbits;
+
+    qt->chunk_size = (qt->nbits + (NUM_CHUNKS - 1)) / NUM_CHUNKS;
+    qt->capacity = 1 << qt->chunk_size;
+    qt->chunk_mask = qt->capacity - 1;
 
-    struct quick_decode *qd = (struct quick_decode*) fam->impl;
     for (int i = 0; i < NUM_CHUNKS; i++) {
-        free(qd->chunk_offsets[i]);
-        free(qd->chunk_ids[i]);
+        qt->shifts[i] = i * qt->chunk_size;
     }
-    free(qd);
-    fam->impl = NULL;
+
+    return sizeof(struct quick_decode_header) +
+        NUM_CHUNKS * (qt->capacity + 1 + qt->ncodes) * sizeof(uint16_t);
 }
 
-static void quick_decode_init(apriltag_family_t *family, int maxhamming)
+static void quick_decode_tables_set_data(struct quick_decode_tables *qt, const void *data, size_t size)
 {
-    assert(family->impl == NULL);
-    assert(family->ncodes < 65536);
+    const uint16_t *offsets = (const uint16_t*) ((const char*) data + sizeof(struct quick_decode_header));
+    const uint16_t *ids = offsets + NUM_CHUNKS * (qt->capacity + 1);
 
-    if (maxhamming > 3) {
-        debug_print("\"maxhamming\" beyond 3 not supported\n");
-        errno = EINVAL;
+    for (int i = 0; i < NUM_CHUNKS; i++) {
+        qt->chunk_offsets[i] = offsets + i * (qt->capacity + 1);
+        qt->chunk_ids[i] = ids + i * qt->ncodes;
+    }
+
+    qt->data = data;
+    qt->size = size;
+}
+
+static void quick_decode_tables_destroy(struct quick_decode_tables *qt)
+{
+    if (!qt)
         return;
+
+    if (qt->fm)
+        file_map_destroy(qt->fm);
+    else
+        free((void*) qt->data);
+    free(qt);
+}
+
+static struct quick_decode_tables *quick_decode_tables_create(const apriltag_family_t *family)
+{
+    assert(family->ncodes < 65536);
+
+    struct quick_decode_tables *qt = calloc(1, sizeof(struct quick_decode_tables));
+    if (!qt) {
+        debug_print("Memory allocation failed\n");
+        return NULL;
     }
 
-    struct quick_decode *qd = calloc(1, sizeof(struct quick_decode));
-    if (!qd) {
+    size_t size = quick_decode_tables_layout(qt, family);
+    char *data = calloc(1, size);
+    uint16_t *cursors = malloc((qt->capacity + 1) * sizeof(uint16_t));
+    if (!data || !cursors) {
         debug_print("Memory allocation failed\n");
-        return;
+        free(data);
+        free(cursors);
+        free(qt);
+        return NULL;
     }
-    family->impl = qd;
 
-    qd->maxhamming = maxhamming;
-    qd->ncodes = family->ncodes;
-    qd->nbits = family->nbits;
+    struct quick_decode_header *header = (struct quick_decode_header*) data;
+    memcpy(header->magic, QUICK_DECODE_MAGIC, sizeof(header->magic));
+    header->nbits = qt->nbits;
+    header->ncodes = qt->ncodes;
+    header->chunk_size = qt->chunk_size;
+    header->checksum = quick_decode_checksum(family);
 
-    qd->chunk_size = (qd->nbits + (NUM_CHUNKS - 1)) / NUM_CHUNKS;
-    qd->capacity = 1 << qd->chunk_size;
-    qd->chunk_mask = qd->capacity - 1;
+    quick_decode_tables_set_data(qt, data, size);
 
     for (int i = 0; i < NUM_CHUNKS; i++) {
-        qd->shifts[i] = i * qd->chunk_size;
-    }
+        uint16_t *chunk_offsets = (uint16_t*) qt->chunk_offsets[i];
+        uint16_t *chunk_ids = (uint16_t*) qt->chunk_ids[i];
 
-    for (int i = 0; i < NUM_CHUNKS; i++) {
-        qd->chunk_offsets[i] = calloc(qd->capacity + 1, sizeof(uint16_t));
-        if (!qd->chunk_offsets[i]) {
-            debug_print("Memory allocation failed\n");
-            goto fail;
-        }
-        qd->chunk_ids[i] = calloc(qd->ncodes, sizeof(uint16_t));
-        if (!qd->chunk_ids[i]) {
-            debug_print("Memory allocation failed\n");
-            goto fail;
+        // Count frequencies
+        for (int j = 0; j < qt->ncodes; j++) {
+            int val = (family->codes[j] >> qt->shifts[i]) & qt->chunk_mask;
+            chunk_offsets[val + 1]++;
         }
-    }
 
-    // Count frequencies
-    for (int i = 0; i < qd->ncodes; i++) {
-        uint64_t code = family->codes[i];
-        for (int j = 0; j < NUM_CHUNKS; j++) {
-            int val = (code >> qd->shifts[j]) & qd->chunk_mask;
-            qd->chunk_offsets[j][val + 1]++;
+        // Prefix sum
+        for (int j = 0; j < qt->capacity; j++) {
+            chunk_offsets[j + 1] += chunk_offsets[j];
         }
-    }
 
-    // Prefix sum
-    for (int i = 0; i < NUM_CHUNKS; i++) {
-        for (int j = 0; j < qd->capacity; j++) {
-            qd->chunk_offsets[i][j + 1] += qd->chunk_offsets[i][j];
+        // Populate ids
+        memcpy(cursors, chunk_offsets, (qt->capacity + 1) * sizeof(uint16_t));
+        for (int j = 0; j < qt->ncodes; j++) {
+            int val = (family->codes[j] >> qt->shifts[i]) & qt->chunk_mask;
+            chunk_ids[cursors[val]++] = j;
         }
     }
 
-    // Populate ids
-    uint16_t *cursors[NUM_CHUNKS];
-    memset(cursors, 0, sizeof(cursors));
-    for (int i = 0; i < NUM_CHUNKS; i++) {
-        cursors[i] = malloc((qd->capacity + 1) * sizeof(uint16_t));
-        if (cursors[i] == NULL) {
-            debug_print("Memory allocation failed\n");
-            for (int j = 0; j < NUM_CHUNKS; j++)
-                free(cursors[j]);
-            goto fail;
-        }
-        memcpy(cursors[i], qd->chunk_offsets[i], (qd->capacity + 1) * sizeof(uint16_t));
+    free(cursors);
+    return qt;
+}
+
+// returns NULL if path does not hold the family's tables, as written
+// by apriltag_family_write_decode_tables.
+static struct quick_decode_tables *quick_decode_tables_map(const apriltag_family_t *family, const char *path)
+{
+    assert(family->ncodes < 65536);
+
+    struct quick_decode_tables *qt = calloc(1, sizeof(struct quick_decode_tables));
+    if (!qt) {
+        debug_print("Memory allocation failed\n");
+        return NULL;
     }
 
-    for (int i = 0; i < qd->ncodes; i++) {
-        uint64_t code = family->codes[i];
-        for (int j = 0; j < NUM_CHUNKS; j++) {
-            int val = (code >> qd->shifts[j]) & qd->chunk_mask;
-            int write_pos = cursors[j][val];
-            qd->chunk_ids[j][write_pos] = i;
-            cursors[j][val]++;
-        }
+    size_t size = quick_decode_tables_layout(qt, family);
+    qt->fm = file_map_create(path);
+    if (!qt->fm) {
+        debug_print("Cannot map %s\n", path);
+        free(qt);
+        return NULL;
     }
 
+    const struct quick_decode_header *header = (const struct quick_decode_header*) qt->fm->data;
+    if (qt->fm->size != size ||
+        memcmp(header->magic, QUICK_DECODE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->nbits != (uint32_t) qt->nbits || header->ncodes != (uint32_t) qt->ncodes ||
+        header->chunk_size != (uint32_t) qt->chunk_size ||
+        header->checksum != quick_decode_checksum(family))
+        goto invalid;
+
+    quick_decode_tables_set_data(qt, qt->fm->data, size);
+
+    // the lookups index the codes with these without further checks.
     for (int i = 0; i < NUM_CHUNKS; i++) {
-        free(cursors[i]);
+        const uint16_t *chunk_offsets = qt->chunk_offsets[i];
+        if (chunk_offsets[0] != 0 || chunk_offsets[qt->capacity] != qt->ncodes)
+            goto invalid;
+        for (int j = 0; j < qt->capacity; j++) {
+            if (chunk_offsets[j] > chunk_offsets[j + 1])
+                goto invalid;
+        }
+
+        int bad = 0;
+        for (int j = 0; j < qt->ncodes; j++)
+            bad |= qt->chunk_ids[i][j] >= qt->ncodes;
+        if (bad)
+            goto invalid;
     }
 
-    return;
+    return qt;
 
-fail:
-    quick_decode_uninit(family);
+invalid:
+    debug_print("%s does not hold the decode tables of %s\n", path, family->name);
+    quick_decode_tables_destroy(qt);
+    return NULL;
 }
 
-// returns a result with hamming set to 255 if no decode was found.
-static void quick_decode_codeword(apriltag_family_t *tf, uint64_t rcode,
-                                  struct quick_decode_result *res)
+// builds the tables of the family if it does not have them yet.
+// Returns NULL if the family is not added to a detector, or if its
+// tables cannot be built.
+static const struct quick_decode_tables *quick_decode_get_tables(apriltag_family_t *family)
+{
+    struct quick_decode *qd = (struct quick_decode*) family->impl;
+    if (!qd)
+        return NULL;
+
+    struct quick_decode_tables *qt = quick_decode_load_tables(&qd->tables);
+    if (qt)
+        return qt;
+
+    qt = quick_decode_tables_create(family);
+    if (!qt)
+        return NULL;
+
+    // another detection may have built them meanwhile.
+    struct quick_decode_tables *published = quick_decode_publish_tables(&qd->tables, qt);
+    if (published != qt)
+        quick_decode_tables_destroy(qt);
+    return published;
+}
+
+// returns non-zero, with errno set to ENOMEM, if the family's
+// quick_decode cannot be allocated.
+static int quick_decode_retain(apriltag_family_t *family)
 {
-    struct quick_decode *qd = (struct quick_decode*) tf->impl;
+    struct quick_decode *qd = (struct quick_decode*) family->impl;
+    if (!qd) {
+        qd = calloc(1, sizeof(struct quick_decode));
+        if (!qd) {
+            debug_print("Memory allocation failed\n");
+            errno = ENOMEM;
+            return -1;
+        }
+        family->impl = qd;
+    }
+    qd->refcount++;
+    return 0;
+}
 
-    // qd might be null if detector_add_family_bits() failed
-    for (int ridx = 0; qd != NULL && ridx < 4; ridx++) {
+static void quick_decode_release(apriltag_family_t *family)
+{
+    struct quick_decode *qd = (struct quick_decode*) family->impl;
+    if (!qd || --qd->refcount > 0)
+        return;
+
+    quick_decode_tables_destroy(qd->tables);
+    free(qd);
+    family->impl = NULL;
+}
+
+// Tries the rotations of rcode in order. Returns non-zero if one
+// matched. hw_popcount selects the compiler's popcount, for callers
+// built for the popcnt instruction.
+static inline int quick_decode_rotations(apriltag_family_t *tf, const struct quick_decode_tables *qt,
+                                         int maxhamming, uint64_t rcode, int hw_popcount,
+                                         struct quick_decode_result *res)
+{
+    for (int ridx = 0; ridx < 4; ridx++) {
 
         for (int i = 0; i < NUM_CHUNKS; i++) {
-            int val = (rcode >> qd->shifts[i]) & qd->chunk_mask;
-            int start = qd->chunk_offsets[i][val];
-            int end = qd->chunk_offsets[i][val + 1];
+            int val = (rcode >> qt->shifts[i]) & qt->chunk_mask;
+            int start = qt->chunk_offsets[i][val];
+            int end = qt->chunk_offsets[i][val + 1];
 
             for (int j = start; j < end; j++) {
-                uint16_t id = qd->chunk_ids[i][j];
+                uint16_t id = qt->chunk_ids[i][j];
                 uint64_t correct_code = tf->codes[id];
-                int hamming = popcount64(correct_code ^ rcode);
+                uint64_t x = correct_code ^ rcode;
+                int hamming = hw_popcount ? simd_popcount64(x) : popcount64(x);
 
-                if (hamming <= qd->maxhamming) {
+                if (hamming <= maxhamming) {
                     res->rcode = rcode;
                     res->id = id;
                     res->hamming = hamming;
                     res->rotation = ridx;
-                    return;
+                    return 1;
                 }
             }
         }
@@ -331,32 +512,159 @@ static void quick_decode_codeword(apriltag_family_t *tf, uint64_t rcode,
         rcode = rotate90(rcode, tf->nbits);
     }
 
+    return 0;
+}
+
+#ifdef APRILTAG_HAVE_AVX2_DISPATCH
+__attribute__((target("popcnt"), flatten))
+static int quick_decode_rotations_popcnt(apriltag_family_t *tf, const struct quick_decode_tables *qt,
+                                         int maxhamming, uint64_t rcode, struct quick_decode_result *res)
+{
+    return quick_decode_rotations(tf, qt, maxhamming, rcode, 1, res);
+}
+#endif
+
+static inline int quick_decode_rotations_dispatch(apriltag_family_t *tf, const struct quick_decode_tables *qt,
+                                                  int maxhamming, uint64_t rcode,
+                                                  struct quick_decode_result *res)
+{
+#ifdef APRILTAG_HAVE_AVX2_DISPATCH
+    if (simd_cpu_has_popcnt())
+        return quick_decode_rotations_popcnt(tf, qt, maxhamming, rcode, res);
+#endif
+    return quick_decode_rotations(tf, qt, maxhamming, rcode, 0, res);
+}
+
+// returns a result with hamming set to 255 if no decode was found.
+static void quick_decode_codeword(apriltag_family_t *tf, const struct quick_decode_tables *qt,
+                                  int maxhamming, uint64_t rcode, struct quick_decode_result *res)
+{
+    // qt might be null if the tables could not be built, and
+    // maxhamming negative if apriltag_detector_add_family_bits()
+    // rejected it.
+    if (qt != NULL && maxhamming >= 0) {
+        if (quick_decode_rotations_dispatch(tf, qt, maxhamming, rcode, res))
+            return;
+    }
+
     res->rcode = 0;
     res->id = 65535;
     res->hamming = 255;
     res->rotation = 0;
 }
 
-static inline int detection_compare_function(const void *_a, const void *_b)
+static inline int compare_doubles(double a, double b)
+{
+    return (a > b) - (a < b);
+}
+
+// Orders the detections by id. Detections with the same id are ordered
+// by what was detected rather than by where their quads were found, as
+// that depends on how the image was split between the threads.
+static int detection_compare_function(const void *_a, const void *_b)
 {
     apriltag_detection_t *a = *(apriltag_detection_t**) _a;
     apriltag_detection_t *b = *(apriltag_detection_t**) _b;
 
-    return a->id - b->id;
+    if (a->id != b->id)
+        return a->id - b->id;
+    if (a->hamming != b->hamming)
+        return a->hamming - b->hamming;
+
+    int cmp = compare_doubles(b->decision_margin, a->decision_margin);
+    for (int i = 0; i < 2 && cmp == 0; i++)
+        cmp = compare_doubles(a->c[i], b->c[i]);
+    for (int i = 0; i < 4 && cmp == 0; i++) {
+        cmp = compare_doubles(a->p[i][0], b->p[i][0]);
+        if (cmp == 0)
+            cmp = compare_doubles(a->p[i][1], b->p[i][1]);
+    }
+    if (cmp == 0)
+        cmp = strcmp(a->family->name, b->family->name);
+
+    return cmp;
 }
 
 void apriltag_detector_remove_family(apriltag_detector_t *td, apriltag_family_t *fam)
 {
-    quick_decode_uninit(fam);
-    zarray_remove_value(td->tag_families, &fam, 0);
+    int idx = zarray_index_of(td->tag_families, &fam);
+    if (idx < 0)
+        return;
+
+    zarray_remove_index(td->tag_families, idx, 0);
+    zarray_remove_index(td->tag_family_bits, idx, 0);
+    quick_decode_release(fam);
 }
 
-void apriltag_detector_add_family_bits(apriltag_detector_t *td, apriltag_family_t *fam, int bits_corrected)
+// adds the family to td, without building its tables. Returns the
+// bits corrected (-1 if not supported, see
+// apriltag_detector_add_family_bits), or -2 if the family cannot be
+// added.
+static int detector_add_family(apriltag_detector_t *td, apriltag_family_t *fam, int bits_corrected)
 {
+    if (bits_corrected > 3) {
+        debug_print("\"maxhamming\" beyond 3 not supported\n");
+        errno = EINVAL;
+        bits_corrected = -1; // decodes nothing
+    }
+
+    if (quick_decode_retain(fam) != 0)
+        return -2;
+
     zarray_add(td->tag_families, &fam);
+    zarray_add(td->tag_family_bits, &bits_corrected);
+    return bits_corrected;
+}
+
+void apriltag_detector_add_family_bits(apriltag_detector_t *td, apriltag_family_t *fam, int bits_corrected)
+{
+    if (detector_add_family(td, fam, bits_corrected) < 0)
+        return;
+
+    if (!quick_decode_get_tables(fam))
+        errno = ENOMEM;
+}
+
+int apriltag_detector_add_family_mapped(apriltag_detector_t *td, apriltag_family_t *fam,
+                                        int bits_corrected, const char *path)
+{
+    int bits = detector_add_family(td, fam, bits_corrected);
+    if (bits == -2)
+        return -1;
+
+    struct quick_decode *qd = (struct quick_decode*) fam->impl;
+    if (quick_decode_load_tables(&qd->tables))
+        return 0;
+
+    struct quick_decode_tables *qt = quick_decode_tables_map(fam, path);
+    if (qt) {
+        if (quick_decode_publish_tables(&qd->tables, qt) != qt)
+            quick_decode_tables_destroy(qt);
+        return 0;
+    }
+
+    if (bits >= 0 && !quick_decode_get_tables(fam))
+        errno = ENOMEM;
+    return -1;
+}
 
-    if (!fam->impl)
-        quick_decode_init(fam, bits_corrected);
+int apriltag_family_write_decode_tables(apriltag_family_t *fam, const char *path)
+{
+    struct quick_decode_tables *qt = quick_decode_tables_create(fam);
+    if (!qt)
+        return -1;
+
+    int res = 0;
+    FILE *f = fopen(path, "wb");
+    if (!f || fwrite(qt->data, 1, qt->size, f) != qt->size) {
+        debug_print("Cannot write %s\n", path);
+        res = -1;
+    }
+    if (f && fclose(f) != 0)
+        res = -1;
+
+    quick_decode_tables_destroy(qt);
+    return res;
 }
 
 void apriltag_detector_clear_families(apriltag_detector_t *td)
@@ -364,9 +672,10 @@ void apriltag_detector_clear_families(apriltag_detector_t *td)
     for (int i = 0; i < zarray_size(td->tag_families); i++) {
         apriltag_family_t *fam;
         zarray_get(td->tag_families, i, &fam);
-        quick_decode_uninit(fam);
+        quick_decode_release(fam);
     }
     zarray_clear(td->tag_families);
+    zarray_clear(td->tag_family_bits);
 }
 
 apriltag_detector_t *apriltag_detector_create()
@@ -384,8 +693,15 @@ apriltag_detector_t *apriltag_detector_create()
     td->qtp.cos_critical_rad = cos(10 * M_PI / 180);
     td->qtp.deglitch = false;
     td->qtp.min_white_black_diff = 5;
+    td->qtp.threshold_tile_size = 4;
+    td->qtp.threshold_local_mean = false;
+    td->qtp.aggregate_points = false;
+    td->qtp.cluster_max_aspect = 0;
+    td->qtp.cluster_min_direction = 0;
+    td->qtp.cluster_max_density = 0;
 
     td->tag_families = zarray_create(sizeof(apriltag_family_t*));
+    td->tag_family_bits = zarray_create(sizeof(int));
 
     pthread_mutex_init(&td->mutex, NULL);
 
@@ -403,17 +719,58 @@ apriltag_detector_t *apriltag_detector_create()
     return td;
 }
 
+void apriltag_detector_set_workerpool(apriltag_detector_t *td, workerpool_t *wp)
+{
+    // created again, from wp, on the next detection.
+    workerpool_destroy(td->wp);
+    td->wp = NULL;
+
+    td->shared_wp = wp;
+    if (wp != NULL)
+        td->nthreads = workerpool_get_nthreads(wp);
+}
+
 void apriltag_detector_destroy(apriltag_detector_t *td)
 {
     timeprofile_destroy(td->tp);
     workerpool_destroy(td->wp);
+    apriltag_workspace_destroy(td->ws);
 
     apriltag_detector_clear_families(td);
 
     zarray_destroy(td->tag_families);
+    zarray_destroy(td->tag_family_bits);
     free(td);
 }
 
+// Families whose tags are laid out alike see the same samples in a
+// quad, so quad_decode_task samples each layout only once per quad.
+// For every family, these are the indices of the first family with the
+// same border (sampled by quad_decode_border) and with the same bit
+// grid (sampled by quad_decode_bits). Each family also gets its
+// decode tables and the number of bits the detector corrects for it.
+struct quad_decode_group
+{
+    int border;
+    int bits;
+
+    const struct quick_decode_tables *tables;
+    int maxhamming;
+};
+
+// What quad_decode_task learned about the current quad from the first
+// family of a group.
+struct quad_decode_state
+{
+    int border_quad, bits_quad; // the quads these were sampled for
+
+    int border_ok;
+    struct graymodel whitemodel, blackmodel;
+
+    uint64_t rcode;
+    float decision_margin;
+};
+
 struct quad_decode_task
 {
     int i0, i1;
@@ -421,9 +778,13 @@ struct quad_decode_task
     apriltag_detector_t *td;
 
     image_u8_t *im;
-    zarray_t *detections;
+    zarray_t *detections; // the task's own, see apriltag_detector_detect
 
     image_u8_t *im_samples;
+
+    const struct quad_decode_group *groups;
+    struct quad_decode_state *states; // one per family
+    double *values, *points; // see quad_decode_bits
 };
 
 struct evaluate_quad_ret
@@ -436,7 +797,8 @@ struct evaluate_quad_ret
     struct quick_decode_result res;
 };
 
-static matd_t* homography_compute2(double c[4][4]) {
+// returns non-zero if the correspondences do not determine H.
+static int homography_compute2(double c[4][4], double H[9]) {
     double A[] =  {
             c[0][0], c[0][1], 1,       0,       0, 0, -c[0][0]*c[0][2], -c[0][1]*c[0][2], c[0][2],
                   0,       0, 0, c[0][0], c[0][1], 1, -c[0][0]*c[0][3], -c[0][1]*c[0][3], c[0][3],
@@ -464,12 +826,12 @@ static matd_t* homography_compute2(double c[4][4]) {
         }
 
         if (max_val_idx < 0) {
-            return NULL;
+            return -1;
         }
 
         if (max_val < epsilon) {
             debug_print("WRN: Matrix is singular.\n");
-            return NULL;
+            return -1;
         }
 
         // Swap to get best row.
@@ -499,11 +861,18 @@ static matd_t* homography_compute2(double c[4][4]) {
         }
         A[col*9 + 8] = (A[col*9 + 8] - sum)/A[col*9 + col];
     }
-    return matd_create_data(3, 3, (double[]) { A[8], A[17], A[26], A[35], A[44], A[53], A[62], A[71], 1 });
+    for (int i = 0; i < 8; i++) {
+        H[i] = A[i*9 + 8];
+    }
+    H[8] = 1;
+    return 0;
 }
 
-// returns non-zero if an error occurs (i.e., H has no inverse)
-static int quad_update_homographies(struct quad *quad)
+// computes the homographies of the quad into H and Hinv (see struct
+// quad), 3x3 and row-major. Decoding keeps them in arrays of its own
+// rather than in quad, so that they need no allocation. Returns
+// non-zero if an error occurs (i.e., H has no inverse)
+static int quad_update_homographies(const struct quad *quad, double H[9], double Hinv[9])
 {
     //zarray_t *correspondences = zarray_create(sizeof(float[4]));
 
@@ -516,23 +885,11 @@ static int quad_update_homographies(struct quad *quad)
         corr_arr[i][3] = quad->p[i][1];
     }
 
-    if (quad->H)
-        matd_destroy(quad->H);
-    if (quad->Hinv)
-        matd_destroy(quad->Hinv);
-
     // XXX Tunable
-    quad->H = homography_compute2(corr_arr);
-    if (quad->H != NULL) {
-        quad->Hinv = matd_inverse(quad->H);
-        if (quad->Hinv != NULL) {
-	    // Success!
-            return 0;
-        }
-        matd_destroy(quad->H);
-        quad->H = NULL;
-    }
-    return -1;
+    if (homography_compute2(corr_arr, H) != 0)
+        return -1;
+
+    return mat33_inverse(H, Hinv);
 }
 
 static double value_for_pixel(image_u8_t *im, double px, double py) {
@@ -551,8 +908,70 @@ static double value_for_pixel(image_u8_t *im, double px, double py) {
             im->buf[y2*im->stride + x2]*x*y;
 }
 
-static void sharpen(apriltag_detector_t* td, double* values, int size) {
-    double *sharpened = malloc(sizeof(double)*size*size);
+// value_for_pixel for the n points (px[i], py[i]), with the same
+// results, computed several points at a time.
+static void values_for_pixels(image_u8_t *im, int n, const double *px, const double *py, double *v)
+{
+    int i = 0;
+
+#ifdef APRILTAG_HAVE_V2F64
+    // value_for_pixel needs floor(p - 0.5) >= 0 and ceil(p - 0.5) <
+    // size, i.e. 0 <= p - 0.5 <= size - 1, where floor is truncation.
+    v2f64 half = v2f64_dup(0.5), zero = v2f64_dup(0), one = v2f64_dup(1);
+    v2f64 xmax = v2f64_dup(im->width - 1), ymax = v2f64_dup(im->height - 1);
+
+    for (; i + 2 <= n; i += 2) {
+        v2f64 sx = v2f64_sub(v2f64_load(&px[i]), half);
+        v2f64 sy = v2f64_sub(v2f64_load(&py[i]), half);
+        v2f64 inside = v2f64_and(v2f64_in_range(sx, zero, xmax), v2f64_in_range(sy, zero, ymax));
+
+        // points outside are sampled at (0, 0) and then discarded.
+        sx = v2f64_and(sx, inside);
+        sy = v2f64_and(sy, inside);
+
+        v2f64 x1 = v2f64_trunc(sx), y1 = v2f64_trunc(sy);
+        v2f64 x = v2f64_sub(sx, x1), y = v2f64_sub(sy, y1);
+
+        double fx1[2], fy1[2], fx[2], fy[2];
+        v2f64_store(fx1, x1);
+        v2f64_store(fy1, y1);
+        v2f64_store(fx, x);
+        v2f64_store(fy, y);
+
+        double b[4][2];
+        for (int k = 0; k < 2; k++) {
+            int ix1 = fx1[k], iy1 = fy1[k];
+            int ix2 = ix1 + (fx[k] > 0), iy2 = iy1 + (fy[k] > 0);
+
+            b[0][k] = im->buf[iy1*im->stride + ix1];
+            b[1][k] = im->buf[iy1*im->stride + ix2];
+            b[2][k] = im->buf[iy2*im->stride + ix1];
+            b[3][k] = im->buf[iy2*im->stride + ix2];
+        }
+
+        // same order of operations as value_for_pixel
+        v2f64 x0 = v2f64_sub(one, x), y0 = v2f64_sub(one, y);
+        v2f64 acc = v2f64_mul(v2f64_mul(v2f64_load(b[0]), x0), y0);
+        acc = v2f64_add(acc, v2f64_mul(v2f64_mul(v2f64_load(b[1]), x), y0));
+        acc = v2f64_add(acc, v2f64_mul(v2f64_mul(v2f64_load(b[2]), x0), y));
+        acc = v2f64_add(acc, v2f64_mul(v2f64_mul(v2f64_load(b[3]), x), y));
+
+        v2f64_store(&v[i], acc);
+
+        uint32_t mask = v2f64_movemask(inside);
+        if (!(mask & 1))
+            v[i] = -1;
+        if (!(mask & 2))
+            v[i + 1] = -1;
+    }
+#endif
+
+    for (; i < n; i++)
+        v[i] = value_for_pixel(im, px[i], py[i]);
+}
+
+// sharpened must hold size*size values.
+static void sharpen(apriltag_detector_t* td, double* values, double *sharpened, int size) {
     double kernel[9] = {
         0, -1, 0,
         -1, 4, -1,
@@ -579,16 +998,46 @@ static void sharpen(apriltag_detector_t* td, double* values, int size) {
             values[y*size + x] = values[y*size + x] + td->decode_sharpening*sharpened[y*size + x];
         }
     }
-
-    free(sharpened);
 }
 
-// returns the decision margin. Return < 0 if the detection should be rejected.
-static float quad_decode(apriltag_detector_t* td, apriltag_family_t *family, image_u8_t *im, struct quad *quad, struct quick_decode_result *res, image_u8_t *im_samples)
+static void quad_decode_groups(zarray_t *families, struct quad_decode_group *groups)
 {
-    // decode the tag binary contents by sampling the pixel
-    // closest to the center of each bit cell.
+    for (int i = 0; i < zarray_size(families); i++) {
+        apriltag_family_t *fi;
+        zarray_get(families, i, &fi);
+
+        groups[i].border = i;
+        groups[i].bits = i;
+
+        for (int j = 0; j < i; j++) {
+            apriltag_family_t *fj;
+            zarray_get(families, j, &fj);
+
+            if (fi->width_at_border != fj->width_at_border ||
+                fi->reversed_border != fj->reversed_border)
+                continue;
+
+            if (groups[i].border == i)
+                groups[i].border = j;
+
+            if (fi->total_width == fj->total_width && fi->nbits == fj->nbits &&
+                memcmp(fi->bit_x, fj->bit_x, fi->nbits*sizeof(uint32_t)) == 0 &&
+                memcmp(fi->bit_y, fj->bit_y, fi->nbits*sizeof(uint32_t)) == 0) {
+                groups[i].bits = j;
+                break;
+            }
+        }
+    }
+}
 
+// fits the gray models to the border of a tag. Returns < 0 if the
+// border does not have the family's polarity. H is the homography of
+// the quad, see quad_update_homographies. points is scratch space for
+// 4*8*width_at_border doubles.
+static int quad_decode_border(apriltag_family_t *family, image_u8_t *im, const double H[9],
+                              struct graymodel *whitemodel, struct graymodel *blackmodel,
+                              double *points, image_u8_t *im_samples)
+{
     // We will compute a threshold by sampling known white/black cells around this tag.
     // This sampling is achieved by considering a set of samples along lines.
     //
@@ -639,28 +1088,40 @@ static float quad_decode(apriltag_detector_t* td, apriltag_family_t *family, ima
         // XXX double-counts the corners.
     };
 
-    struct graymodel whitemodel, blackmodel;
-    graymodel_init(&whitemodel);
-    graymodel_init(&blackmodel);
+    graymodel_init(whitemodel);
+    graymodel_init(blackmodel);
 
-    for (long unsigned int pattern_idx = 0; pattern_idx < sizeof(patterns)/(5*sizeof(float)); pattern_idx ++) {
-        float *pattern = &patterns[pattern_idx * 5];
+    int npatterns = sizeof(patterns)/(5*sizeof(float));
+    int npoints = npatterns*family->width_at_border;
+    double *tagxs = points, *tagys = &points[npoints];
+    double *pxs = &points[2*npoints], *pys = &points[3*npoints];
 
-        int is_white = pattern[4];
+    for (int pattern_idx = 0; pattern_idx < npatterns; pattern_idx++) {
+        float *pattern = &patterns[pattern_idx * 5];
 
         for (int i = 0; i < family->width_at_border; i++) {
             double tagx01 = (pattern[0] + i*pattern[2]) / (family->width_at_border);
             double tagy01 = (pattern[1] + i*pattern[3]) / (family->width_at_border);
 
-            double tagx = 2*(tagx01-0.5);
-            double tagy = 2*(tagy01-0.5);
+            tagxs[pattern_idx*family->width_at_border + i] = 2*(tagx01-0.5);
+            tagys[pattern_idx*family->width_at_border + i] = 2*(tagy01-0.5);
+        }
+    }
+
+    homography_project_n(H, npoints, tagxs, tagys, pxs, pys);
+
+    for (int pattern_idx = 0; pattern_idx < npatterns; pattern_idx++) {
+        float *pattern = &patterns[pattern_idx * 5];
+
+        int is_white = pattern[4];
 
-            double px, py;
-            homography_project(quad->H, tagx, tagy, &px, &py);
+        for (int i = 0; i < family->width_at_border; i++) {
+            int k = pattern_idx*family->width_at_border + i;
+            double tagx = tagxs[k], tagy = tagys[k];
 
             // don't round
-            int ix = px;
-            int iy = py;
+            int ix = pxs[k];
+            int iy = pys[k];
             if (ix < 0 || iy < 0 || ix >= im->width || iy >= im->height)
                 continue;
 
@@ -671,27 +1132,38 @@ static float quad_decode(apriltag_detector_t* td, apriltag_family_t *family, ima
             }
 
             if (is_white)
-                graymodel_add(&whitemodel, tagx, tagy, v);
+                graymodel_add(whitemodel, tagx, tagy, v);
             else
-                graymodel_add(&blackmodel, tagx, tagy, v);
+                graymodel_add(blackmodel, tagx, tagy, v);
         }
     }
 
     if (family->width_at_border > 1) {
-        graymodel_solve(&whitemodel);
-        graymodel_solve(&blackmodel);
+        graymodel_solve(whitemodel);
+        graymodel_solve(blackmodel);
     } else {
-        graymodel_solve(&whitemodel);
-        blackmodel.C[0] = 0;
-        blackmodel.C[1] = 0;
-        blackmodel.C[2] = blackmodel.B[2]/4;
+        graymodel_solve(whitemodel);
+        blackmodel->C[0] = 0;
+        blackmodel->C[1] = 0;
+        blackmodel->C[2] = blackmodel->B[2]/4;
     }
 
     // XXX Tunable
-    if ((graymodel_interpolate(&whitemodel, 0, 0) - graymodel_interpolate(&blackmodel, 0, 0) < 0) != family->reversed_border) {
+    if ((graymodel_interpolate(whitemodel, 0, 0) - graymodel_interpolate(blackmodel, 0, 0) < 0) != family->reversed_border) {
         return -1;
     }
 
+    return 0;
+}
+
+// decode the tag binary contents by sampling the pixel closest to the
+// center of each bit cell, thresholding it against the gray models
+// from quad_decode_border. Returns the decision margin. values and
+// points are scratch space for 2*total_width^2 and 5*nbits doubles.
+static float quad_decode_bits(apriltag_detector_t* td, apriltag_family_t *family, image_u8_t *im, const double H[9],
+                              struct graymodel *whitemodel, struct graymodel *blackmodel,
+                              uint64_t *prcode, double *values, double *points, image_u8_t *im_samples)
+{
     // compute the average decision margin (how far was each bit from
     // the decision boundary?
     //
@@ -701,10 +1173,13 @@ static float quad_decode(apriltag_detector_t* td, apriltag_family_t *family, ima
     float black_score = 0, white_score = 0;
     float black_score_count = 1, white_score_count = 1;
 
-    double *values = calloc(family->total_width*family->total_width, sizeof(double));
+    memset(values, 0, family->total_width*family->total_width*sizeof(double));
 
-    int min_coord = (family->width_at_border - family->total_width)/2;
-    for (uint32_t i = 0; i < family->nbits; i++) {
+    int nbits = family->nbits;
+    double *tagxs = points, *tagys = &points[nbits];
+    double *pxs = &points[2*nbits], *pys = &points[3*nbits], *vs = &points[4*nbits];
+
+    for (int i = 0; i < nbits; i++) {
         int bity = family->bit_y[i];
         int bitx = family->bit_x[i];
 
@@ -712,19 +1187,27 @@ static float quad_decode(apriltag_detector_t* td, apriltag_family_t *family, ima
         double tagy01 = (bity + 0.5) / (family->width_at_border);
 
         // scale to [-1, 1]
-        double tagx = 2*(tagx01-0.5);
-        double tagy = 2*(tagy01-0.5);
+        tagxs[i] = 2*(tagx01-0.5);
+        tagys[i] = 2*(tagy01-0.5);
+    }
+
+    homography_project_n(H, nbits, tagxs, tagys, pxs, pys);
+    values_for_pixels(im, nbits, pxs, pys, vs);
 
-        double px, py;
-        homography_project(quad->H, tagx, tagy, &px, &py);
+    int min_coord = (family->width_at_border - family->total_width)/2;
+    for (int i = 0; i < nbits; i++) {
+        int bity = family->bit_y[i];
+        int bitx = family->bit_x[i];
 
-        double v = value_for_pixel(im, px, py);
+        double tagx = tagxs[i], tagy = tagys[i];
+        double px = pxs[i], py = pys[i];
+        double v = vs[i];
 
         if (v == -1) {
             continue;
         }
 
-        double thresh = (graymodel_interpolate(&blackmodel, tagx, tagy) + graymodel_interpolate(&whitemodel, tagx, tagy)) / 2.0;
+        double thresh = (graymodel_interpolate(blackmodel, tagx, tagy) + graymodel_interpolate(whitemodel, tagx, tagy)) / 2.0;
         values[family->total_width*(bity - min_coord) + bitx - min_coord] = v - thresh;
 
         if (im_samples) {
@@ -734,7 +1217,7 @@ static float quad_decode(apriltag_detector_t* td, apriltag_family_t *family, ima
         }
     }
 
-    sharpen(td, values, family->total_width);
+    sharpen(td, values, &values[family->total_width*family->total_width], family->total_width);
 
     uint64_t rcode = 0;
     for (uint32_t i = 0; i < family->nbits; i++) {
@@ -753,8 +1236,7 @@ static float quad_decode(apriltag_detector_t* td, apriltag_family_t *family, ima
         }
     }
 
-    quick_decode_codeword(family, rcode, res);
-    free(values);
+    *prcode = rcode;
     return fmin(white_score / white_score_count, black_score / black_score_count);
 }
 
@@ -951,7 +1433,8 @@ static void quad_decode_task(void *_u)
         }
 
         // make sure the homographies are computed...
-        if (quad_update_homographies(quad_original) != 0)
+        double H[9], Hinv[9];
+        if (quad_update_homographies(quad_original, H, Hinv) != 0)
             continue;
 
         for (int famidx = 0; famidx < zarray_size(td->tag_families); famidx++) {
@@ -962,13 +1445,29 @@ static void quad_decode_task(void *_u)
                 continue;
             }
 
-            // since the geometry of tag families can vary, start any
-            // optimization process over with the original quad.
-            struct quad *quad = quad_copy(quad_original);
+            struct quad_decode_state *border = &task->states[task->groups[famidx].border];
+            if (border->border_quad != quadidx) {
+                border->border_quad = quadidx;
+                border->border_ok = quad_decode_border(family, im, H, &border->whitemodel,
+                                                       &border->blackmodel, task->points, task->im_samples) == 0;
+            }
+
+            if (!border->border_ok)
+                continue;
+
+            struct quad_decode_state *bits = &task->states[task->groups[famidx].bits];
+            if (bits->bits_quad != quadidx) {
+                bits->bits_quad = quadidx;
+                bits->decision_margin = quad_decode_bits(td, family, im, H, &border->whitemodel,
+                                                         &border->blackmodel, &bits->rcode, task->values,
+                                                         task->points, task->im_samples);
+            }
 
             struct quick_decode_result res;
+            quick_decode_codeword(family, task->groups[famidx].tables, task->groups[famidx].maxhamming,
+                                  bits->rcode, &res);
 
-            float decision_margin = quad_decode(td, family, im, quad, &res, task->im_samples);
+            float decision_margin = bits->decision_margin;
 
             if (decision_margin >= 0 && res.hamming < 255) {
                 apriltag_detection_t *det = calloc(1, sizeof(apriltag_detection_t));
@@ -981,17 +1480,21 @@ static void quad_decode_task(void *_u)
                 double theta = res.rotation * M_PI / 2.0;
                 double c = cos(theta), s = sin(theta);
 
-                // Fix the rotation of our homography to properly orient the tag
-                matd_t *R = matd_create(3,3);
-                MATD_EL(R, 0, 0) = c;
-                MATD_EL(R, 0, 1) = -s;
-                MATD_EL(R, 1, 0) = s;
-                MATD_EL(R, 1, 1) = c;
-                MATD_EL(R, 2, 2) = 1;
-
-                det->H = matd_op("M*M", quad->H, R);
-
-                matd_destroy(R);
+                // Fix the rotation of our homography to properly orient
+                // the tag: H*R, summed in the order matd_multiply does.
+                const double R[9] = { c, -s, 0,
+                                      s,  c, 0,
+                                      0,  0, 1 };
+
+                det->H = matd_create(3,3);
+                for (int i = 0; i < 3; i++) {
+                    for (int j = 0; j < 3; j++) {
+                        double acc = 0;
+                        for (int k = 0; k < 3; k++)
+                            acc += H[i*3 + k] * R[k*3 + j];
+                        MATD_EL(det->H, i, j) = acc;
+                    }
+                }
 
                 homography_project(det->H, 0, 0, &det->c[0], &det->c[1]);
 
@@ -1011,12 +1514,8 @@ static void quad_decode_task(void *_u)
                     det->p[i][1] = p[1];
                 }
 
-                pthread_mutex_lock(&td->mutex);
                 zarray_add(task->detections, &det);
-                pthread_mutex_unlock(&td->mutex);
             }
-
-            quad_destroy(quad);
         }
     }
 }
@@ -1058,9 +1557,15 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
         return s;
     }
 
+    if (td->shared_wp != NULL)
+        td->nthreads = workerpool_get_nthreads(td->shared_wp);
+
     if (td->wp == NULL || td->nthreads != workerpool_get_nthreads(td->wp)) {
         workerpool_destroy(td->wp);
-        td->wp = workerpool_create(td->nthreads);
+        if (td->shared_wp != NULL)
+            td->wp = workerpool_create_shared(td->shared_wp);
+        else
+            td->wp = workerpool_create_pinned(td->nthreads, td->thread_ncpus, td->thread_cpus);
         if (td->wp == NULL) {
             // creating workerpool failed - return empty zarray
             return zarray_create(sizeof(apriltag_detection_t*));
@@ -1075,7 +1580,9 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
     // and blurring parameters.
     image_u8_t *quad_im = im_orig;
     if (td->quad_decimate > 1) {
-        quad_im = image_u8_decimate(im_orig, td->quad_decimate);
+        quad_im = apriltag_workspace_decimate(td, im_orig, td->quad_decimate);
+        if (quad_im == NULL)
+            return zarray_create(sizeof(apriltag_detection_t*));
 
         timeprofile_stamp(td->tp, "decimate");
     }
@@ -1103,24 +1610,7 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
                 image_u8_gaussian_blur_parallel(td->wp, quad_im, sigma, ksz);
             } else {
                 // SHARPEN the image by subtracting the low frequency components.
-                image_u8_t *orig = image_u8_copy(quad_im);
-                image_u8_gaussian_blur_parallel(td->wp, quad_im, sigma, ksz);
-
-                for (int y = 0; y < orig->height; y++) {
-                    for (int x = 0; x < orig->width; x++) {
-                        int vorig = orig->buf[y*orig->stride + x];
-                        int vblur = quad_im->buf[y*quad_im->stride + x];
-
-                        int v = 2*vorig - vblur;
-                        if (v < 0)
-                            v = 0;
-                        if (v > 255)
-                            v = 255;
-
-                        quad_im->buf[y*quad_im->stride + x] = (uint8_t) v;
-                    }
-                }
-                image_u8_destroy(orig);
+                image_u8_unsharp_mask_parallel(td->wp, quad_im, sigma, ksz);
             }
         }
     }
@@ -1146,9 +1636,6 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
         }
     }
 
-    if (quad_im != im_orig)
-        image_u8_destroy(quad_im);
-
     zarray_t *detections = zarray_create(sizeof(apriltag_detection_t*));
 
     td->nquads = zarray_size(quads);
@@ -1184,9 +1671,41 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
     if (1) {
         image_u8_t *im_samples = td->debug ? image_u8_copy(im_orig) : NULL;
 
-        int chunksize = 1 + zarray_size(quads) / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
+        int64_t utime0 = utime_now();
+        int chunksize = apriltag_task_chunksize(td, APRILTAG_STAGE_DECODE, zarray_size(quads));
+
+        int maxtasks = zarray_size(quads) / chunksize + 1;
+        struct quad_decode_task *tasks = malloc(sizeof(struct quad_decode_task)*maxtasks);
+
+        int nfamilies = zarray_size(td->tag_families);
+        struct quad_decode_group *groups = malloc(sizeof(struct quad_decode_group)*nfamilies);
+        quad_decode_groups(td->tag_families, groups);
+        for (int i = 0; i < nfamilies; i++) {
+            apriltag_family_t *family;
+            zarray_get(td->tag_families, i, &family);
+            // NULL only if building them failed when the family was
+            // added, and again now.
+            groups[i].tables = quick_decode_get_tables(family);
+            if (!groups[i].tables)
+                errno = ENOMEM;
+            zarray_get(td->tag_family_bits, i, &groups[i].maxhamming);
+        }
 
-        struct quad_decode_task *tasks = malloc(sizeof(struct quad_decode_task)*(zarray_size(quads) / chunksize + 1));
+        struct quad_decode_state *states = malloc(sizeof(struct quad_decode_state)*nfamilies*maxtasks);
+        for (int i = 0; i < nfamilies*maxtasks; i++) {
+            states[i].border_quad = -1;
+            states[i].bits_quad = -1;
+        }
+
+        int nvalues = 0, npoints = 0;
+        for (int i = 0; i < nfamilies; i++) {
+            apriltag_family_t *family;
+            zarray_get(td->tag_families, i, &family);
+            nvalues = imax(nvalues, 2*family->total_width*family->total_width);
+            npoints = imax(npoints, 5*imax(family->nbits, 8*family->width_at_border));
+        }
+        double *values = malloc(sizeof(double)*nvalues*maxtasks);
+        double *points = malloc(sizeof(double)*npoints*maxtasks);
 
         int ntasks = 0;
         for (int i = 0; i < zarray_size(quads); i+= chunksize) {
@@ -1195,9 +1714,15 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
             tasks[ntasks].quads = quads;
             tasks[ntasks].td = td;
             tasks[ntasks].im = im_orig;
-            tasks[ntasks].detections = detections;
+            // joined in task order below, so that the order of the
+            // detections does not depend on how the tasks ran.
+            tasks[ntasks].detections = zarray_create(sizeof(apriltag_detection_t*));
 
             tasks[ntasks].im_samples = im_samples;
+            tasks[ntasks].groups = groups;
+            tasks[ntasks].states = &states[ntasks*nfamilies];
+            tasks[ntasks].values = &values[ntasks*nvalues];
+            tasks[ntasks].points = &points[ntasks*npoints];
 
             workerpool_add_task(td->wp, quad_decode_task, &tasks[ntasks]);
             ntasks++;
@@ -1205,7 +1730,18 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
 
         workerpool_run(td->wp);
 
+        apriltag_task_timing(td, APRILTAG_STAGE_DECODE, zarray_size(quads), ntasks, utime0);
+
+        for (int i = 0; i < ntasks; i++) {
+            zarray_add_range(detections, tasks[i].detections, 0, zarray_size(tasks[i].detections));
+            zarray_destroy(tasks[i].detections);
+        }
+
         free(tasks);
+        free(groups);
+        free(states);
+        free(values);
+        free(points);
 
         if (im_samples != NULL) {
             image_u8_write_pnm(im_samples, "debug_samples.pnm");
@@ -1440,13 +1976,6 @@ zarray_t *apriltag_detector_detect(apriltag_detector_t *td, image_u8_t *im_orig)
 
     timeprofile_stamp(td->tp, "debug output");
 
-    for (int i = 0; i < zarray_size(quads); i++) {
-        struct quad *quad;
-        zarray_get_volatile(quads, i, &quad);
-        matd_destroy(quad->H);
-        matd_destroy(quad->Hinv);
-    }
-
     zarray_destroy(quads);
 
     zarray_sort(detections, detection_compare_function);
@@ -1545,8 +2074,11 @@ apriltag_detector_t *apriltag_detector_copy(apriltag_detector_t *src)
 
     // Reinitialize pointer fields to independent default values to avoid shared ownership and double-free issues
     dst->tag_families = zarray_create(sizeof(apriltag_family_t *));
+    dst->tag_family_bits = zarray_create(sizeof(int));
     dst->tp = timeprofile_create();
-    dst->wp = workerpool_create(src->nthreads);
+    dst->wp = src->shared_wp != NULL ? NULL :
+        workerpool_create_pinned(src->nthreads, src->thread_ncpus, src->thread_cpus);
+    dst->ws = NULL;
 
     return dst;
 }
@@ -84,6 +84,8 @@ struct apriltag_family
     // some detector implementations may preprocess codes in order to
     // accelerate decoding.  They put their data here. (Do not use the
     // same apriltag_family instance in more than one implementation)
+    // The tables of apriltag_detector are built when the family is first
+    // added to a detector, and shared by all the detectors it is added to.
     void *impl;
 };
 
@@ -118,8 +120,49 @@ struct apriltag_quad_thresh_params
     // should the thresholded image be deglitched? Only useful for
     // very noisy images
     int deglitch;
+
+    // size (in pixels) of the tiles used to build the local model of
+    // black & white. Each pixel is thresholded using the statistics
+    // of the 3x3 tiles around it. Larger tiles are cheaper on high
+    // resolution images, smaller tiles suit heavily decimated ones.
+    int threshold_tile_size;
+
+    // threshold each pixel against the mean of a window about as
+    // large as the 3x3 tiles around it (computed from summed-area
+    // tables), rather than against the tiles' min/max. The cost of
+    // this mode does not depend on threshold_tile_size.
+    int threshold_local_mean;
+
+    // combine the boundary points a pixel contributes to the same
+    // cluster (up to four, one per neighbor) into a single point at
+    // their mean, with their gradients summed, weighing in the line
+    // fits as much as the points it replaces. Clusters shrink to about
+    // half, which makes fitting quads cheaper at some cost in corner
+    // accuracy. Note that min_cluster_pixels then counts the combined
+    // points.
+    int aggregate_points;
+
+    // Reject clusters that cannot be quads from cheap statistics of
+    // their points, before they are sorted and lines are fit to them.
+    // Each test is off when zero (the default).
+    //
+    // the most the longer side of a cluster's bounding box may be, as
+    // a multiple of the shorter side.
+    float cluster_max_aspect;
+
+    // the least fraction of a cluster's points whose gradient must
+    // point each of left, right, up and down. The four edges of a
+    // quad cover all of them; a lone edge or corner does not.
+    float cluster_min_direction;
+
+    // the most points a cluster may have per pixel of the perimeter of
+    // its bounding box. The boundary of a quad has at most about 4 (a
+    // pixel adds up to four points); a patch of texture has many more.
+    float cluster_max_density;
 };
 
+struct apriltag_workspace;
+
 // Represents a detector object. Upon creating a detector, all fields
 // are set to reasonable values, but can be overridden by accessing
 // these fields.
@@ -129,9 +172,17 @@ struct apriltag_detector
     ///////////////////////////////////////////////////////////////
     // User-configurable parameters.
 
-    // How many threads should be used?
+    // How many threads should be used? (Including the calling thread,
+    // which runs detection tasks too.)
     int nthreads;
 
+    // Optionally, the CPUs each of the nthreads - 1 other threads may
+    // run on, as in workerpool_create_pinned. Read when the threads are
+    // created, on the first detection and when nthreads changes. NULL
+    // (the default) leaves them unpinned. Not freed by the detector.
+    const int *thread_ncpus;
+    const int *thread_cpus;
+
     // detection of quads can be done on a lower-resolution image,
     // improving speed at a cost of pose accuracy and a slight
     // decrease in detection rate. Decoding the binary payload is
@@ -183,9 +234,22 @@ struct apriltag_detector
     // tag family passed into the constructor.
     zarray_t *tag_families;
 
+    // The bits_corrected of each of tag_families (int), -1 if it was
+    // not supported.
+    zarray_t *tag_family_bits;
+
     // Used to manage multi-threading.
     workerpool_t *wp;
 
+    // Set by apriltag_detector_set_workerpool, wp then runs its tasks
+    // on the threads of this one. Not freed on apriltag_detector_destroy.
+    workerpool_t *shared_wp;
+
+    // Buffers kept between frames, so that a stream of images of the
+    // same size is processed without reallocating them. Created on
+    // the first detection.
+    struct apriltag_workspace *ws;
+
     // Used for thread safety.
     pthread_mutex_t mutex;
 };
@@ -234,9 +298,30 @@ struct apriltag_detection
 apriltag_detector_t *apriltag_detector_create();
 
 // add a family to the apriltag detector. caller still "owns" the family.
-// a single instance should only be provided to one apriltag detector instance.
+// a single instance can be added to several detectors, also with
+// different bits_corrected, and they share its decode tables, built when
+// it is first added. Adding and removing families must not happen
+// concurrently with each other, but may with detections. bits_corrected
+// beyond 3 is not supported: it sets errno to EINVAL, and the family then
+// never decodes. If the family cannot be added, or its tables cannot be
+// built, errno is set to ENOMEM. (Detections then retry building them,
+// and set errno to ENOMEM while they cannot.)
 void apriltag_detector_add_family_bits(apriltag_detector_t *td, apriltag_family_t *fam, int bits_corrected);
 
+// like apriltag_detector_add_family_bits, but if the family's decode
+// tables are not built yet, maps them read-only from path, as written by
+// apriltag_family_write_decode_tables. Processes mapping the same file
+// share its memory. Returns non-zero if path does not hold the family's
+// tables, in which case they are built as usual, or if the family cannot
+// be added.
+int apriltag_detector_add_family_mapped(apriltag_detector_t *td, apriltag_family_t *fam,
+                                        int bits_corrected, const char *path);
+
+// writes the decode tables of the family to path, for
+// apriltag_detector_add_family_mapped. The file is only valid on
+// machines with the same byte order. Returns non-zero on failure.
+int apriltag_family_write_decode_tables(apriltag_family_t *fam, const char *path);
+
 // Tunable, but really, 2 is a good choice. Values of >=3
 // consume prohibitively large amounts of memory, and otherwise
 // you want the largest value possible.
@@ -245,6 +330,15 @@ static inline void apriltag_detector_add_family(apriltag_detector_t *td, aprilta
     apriltag_detector_add_family_bits(td, fam, 2);
 }
 
+// Runs the detector's tasks on the threads of wp (see
+// workerpool_create), instead of creating its own. The same pool can be
+// used by several detectors, including ones detecting at the same time
+// from different threads, without oversubscribing the cores. td->nthreads
+// is then set to the pool's. The caller still owns wp, and must destroy
+// it after the detectors. Pass NULL to go back to the detector's own
+// threads.
+void apriltag_detector_set_workerpool(apriltag_detector_t *td, workerpool_t *wp);
+
 // does not deallocate the family.
 void apriltag_detector_remove_family(apriltag_detector_t *td, apriltag_family_t *fam);
 
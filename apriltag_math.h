@@ -99,3 +99,89 @@ static inline void mat33_sym_solve(const double *A,
     R[1] = M[4]*tmp[1] + M[7]*tmp[2];
     R[2] = M[8]*tmp[2];
 }
+
+// Inverts A into R by LU decomposition with partial pivoting, following
+// matd_inverse step for step so that both agree on which matrices are
+// singular. Returns non-zero, leaving R undefined, if A is singular.
+static inline int mat33_inverse(const double *A,
+                                double *R)
+{
+    double LU[9];
+    int piv[3] = { 0, 1, 2 };
+    int singular = 0;
+
+    for (int i = 0; i < 9; i++)
+        LU[i] = A[i];
+
+    for (int j = 0; j < 3; j++) {
+        for (int i = 0; i < 3; i++) {
+            int kmax = i < j ? i : j;
+
+            double acc = 0;
+            for (int k = 0; k < kmax; k++)
+                acc += LU[i*3 + k] * LU[k*3 + j];
+
+            LU[i*3 + j] -= acc;
+        }
+
+        int p = j;
+        for (int i = j + 1; i < 3; i++) {
+            if (fabs(LU[i*3 + j]) > fabs(LU[p*3 + j]))
+                p = i;
+        }
+
+        if (p != j) {
+            for (int k = 0; k < 3; k++) {
+                double tmp = LU[p*3 + k];
+                LU[p*3 + k] = LU[j*3 + k];
+                LU[j*3 + k] = tmp;
+            }
+            int k = piv[p];
+            piv[p] = piv[j];
+            piv[j] = k;
+        }
+
+        double LUjj = LU[j*3 + j];
+
+        // MATD_EPS
+        if (fabs(LUjj) < 1e-8)
+            singular = 1;
+
+        if (LUjj != 0) {
+            LUjj = 1.0 / LUjj;
+            for (int i = j + 1; i < 3; i++)
+                LU[i*3 + j] *= LUjj;
+        }
+    }
+
+    if (singular)
+        return -1;
+
+    // solve LU R = P I
+    for (int i = 0; i < 3; i++) {
+        for (int t = 0; t < 3; t++)
+            R[i*3 + t] = piv[i] == t;
+    }
+
+    for (int k = 0; k < 3; k++) {
+        for (int i = k + 1; i < 3; i++) {
+            double LUik = -LU[i*3 + k];
+            for (int t = 0; t < 3; t++)
+                R[i*3 + t] += R[k*3 + t] * LUik;
+        }
+    }
+
+    for (int k = 2; k >= 0; k--) {
+        double LUkk = 1.0 / LU[k*3 + k];
+        for (int t = 0; t < 3; t++)
+            R[k*3 + t] *= LUkk;
+
+        for (int i = 0; i < k; i++) {
+            double LUik = -LU[i*3 + k];
+            for (int t = 0; t < 3; t++)
+                R[i*3 + t] += R[k*3 + t] * LUik;
+        }
+    }
+
+    return 0;
+}
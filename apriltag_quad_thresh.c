@@ -36,13 +36,17 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include <stdint.h>
 
 #include "apriltag.h"
+#include "apriltag_tasks.h"
 #include "common/image_u8x3.h"
 #include "common/zarray.h"
 #include "common/unionfind.h"
 #include "common/timeprofile.h"
+#include "common/time_util.h"
 #include "common/zmaxheap.h"
 #include "common/postscript_utils.h"
 #include "common/math_util.h"
+#include "common/simd.h"
+#include "common/debug_print.h"
 
 #ifdef _WIN32
 static inline long int random(void)
@@ -51,17 +55,18 @@ static inline long int random(void)
 }
 #endif
 
-static inline uint32_t u64hash_2(uint64_t x) {
-    return (2654435761 * x) >> 32;
-}
-
-struct uint64_zarray_entry
+// The finalizer of MurmurHash3, which mixes every bit of x into every
+// bit of the result. (Cluster ids are two union-find ids side by side,
+// so a plain multiplicative hash mostly sees the low one.)
+static inline uint64_t u64hash_mix(uint64_t x)
 {
-    uint64_t id;
-    zarray_t *cluster;
-
-    struct uint64_zarray_entry *next;
-};
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
 
 struct pt
 {
@@ -69,22 +74,60 @@ struct pt
     uint16_t x, y;
     int16_t gx, gy;
 
+    // how many boundary points this one stands for: more than one if
+    // they were aggregated (see apriltag_quad_thresh_params).
+    uint16_t n;
+};
+
+// the slope of the point at index, in fit_quad.
+struct pt_key
+{
     float slope;
+    uint32_t index;
+};
+
+// A horizontal run [x0, x1] of valid pixels of the same color.
+struct thresh_run
+{
+    uint16_t x0, x1;
+    uint8_t white;
+};
+
+// The thresholded image, packed into two bitplanes. In each row, bit
+// x%64 of word x/64 of valid is set if pixel x has enough contrast to
+// be classified, and the same bit of polarity is set if the pixel is
+// white. Bits past the width of the image are always zero, and each
+// row has at least one word of such padding. (Unpacked, these are the
+// 127, 0 and 255 pixels of the thresholded image.)
+struct thresh_image
+{
+    int width, height;
+    int stride; // in words
+
+    uint64_t *valid;
+    uint64_t *polarity;
+
+    // the runs of each row, which are the nodes of the connected
+    // components (see connected_components). Row y has the runs
+    // [row_runs[y], row_runs[y+1]), in increasing x.
+    uint32_t *row_runs;
+    struct thresh_run *runs;
 };
 
 struct unionfind_task
 {
     int y0, y1;
-    int w, h, s;
+    int w, h;
     unionfind_t *uf;
-    image_u8_t *im;
+    struct thresh_image *im;
+    zarray_t *linked; // roots linked while stitching, see do_stitch_task
 };
 
 struct quad_task
 {
     zarray_t *clusters;
     int cidx0, cidx1; // [cidx0, cidx1)
-    zarray_t *quads;
+    zarray_t *quads; // the task's own, see fit_quads
     apriltag_detector_t *td;
     int w, h;
 
@@ -92,6 +135,7 @@ struct quad_task
     int tag_width;
     bool normal_border;
     bool reversed_border;
+    struct fit_quad_scratch *scratch;
 };
 
 
@@ -100,39 +144,204 @@ struct cluster_task
     int y0;
     int y1;
     int w;
-    int s;
-    int nclustermap;
+    bool aggregate;
+    struct cluster_map *map;
     unionfind_t* uf;
-    image_u8_t* im;
-    zarray_t* clusters;
+    struct thresh_image* im;
 };
 
-struct minmax_task {
-    int ty;
+struct threshold_task {
+    int ty0, ty1; // [ty0, ty1), in tile rows
+    int tilesz;
 
+    apriltag_detector_t *td;
     image_u8_t *im;
-    uint8_t *im_max;
-    uint8_t *im_min;
+    struct thresh_image *threshim;
+
+    // room for three rows of tile maxima and minima, one blurred row
+    // of each, two rows of pixels and one tile row of thresholded
+    // pixels. (See do_threshold_task.)
+    uint8_t *scratch;
 };
 
-struct blur_task {
-    int ty;
+struct local_mean_task {
+    int i0, i1; // [i0, i1), rows or columns depending on the pass
+    int r;      // half-width of the averaging window
 
+    apriltag_detector_t *td;
     image_u8_t *im;
-    uint8_t *im_max;
-    uint8_t *im_min;
-    uint8_t *im_max_tmp;
-    uint8_t *im_min_tmp;
+    struct thresh_image *threshim;
+
+    // summed-area tables of the pixel values and of their squares,
+    // (w+1)x(h+1) with a leading row and column of zeros.
+    uint32_t *sum;
+    uint32_t *sumsq;
+
+    uint8_t *row; // one thresholded row, for do_local_mean_task
 };
 
-struct threshold_task {
-    int ty;
+// A buffer kept from one frame to the next, which only ever grows.
+struct ws_buffer
+{
+    void *data;
+    size_t capacity; // in bytes
+};
 
-    apriltag_detector_t *td;
-    image_u8_t *im;
-    image_u8_t *threshim;
-    uint8_t *im_max;
-    uint8_t *im_min;
+// Returns at least sz bytes of b, growing it if needed, or NULL if
+// that fails. The contents are not preserved when it grows.
+static void *ws_reserve(struct ws_buffer *b, size_t sz)
+{
+    if (sz > b->capacity || b->data == NULL) {
+        // leave some room, as the number of runs, tasks, etc. varies
+        // a little from frame to frame.
+        size_t capacity = b->capacity + b->capacity / 2;
+        if (capacity < sz)
+            capacity = sz;
+        if (capacity == 0)
+            capacity = 1;
+        free(b->data);
+        b->data = malloc(capacity);
+        if (b->data == NULL) {
+            debug_print("Memory allocation failed\n");
+            b->capacity = 0;
+            return NULL;
+        }
+        b->capacity = capacity;
+    }
+    return b->data;
+}
+
+static void ws_buffer_free(struct ws_buffer *b)
+{
+    free(b->data);
+    b->data = NULL;
+    b->capacity = 0;
+}
+
+// A slot of the open-addressing table of cluster ids. Empty slots
+// have id 0, which no cluster has (see do_gradient_clusters).
+struct cluster_slot
+{
+    uint64_t id;
+    uint32_t cluster; // index into cluster_map.info
+};
+
+struct cluster_info
+{
+    uint64_t id;
+    uint32_t slot;  // where the id is in the table
+    uint32_t index; // position in order of first appearance
+    uint32_t npts;
+};
+
+// a boundary point, tagged with the cluster it belongs to.
+struct cluster_pt
+{
+    struct pt p;
+    uint32_t cluster;
+};
+
+// the points of one cluster found by one gradient cluster task.
+struct cluster_ref
+{
+    uint64_t id;
+    struct pt *pts;
+    uint32_t npts;
+};
+
+// The clusters of one gradient cluster task. The table is a power of
+// two in size, at most half full, and is empty between frames. Points
+// are appended to pts in scan order, then grouped by cluster (keeping
+// that order) into grouped, and refs lists the clusters by
+// increasing id.
+struct cluster_map
+{
+    struct cluster_slot *slots;
+    uint32_t nslots;
+
+    zarray_t *info; // struct cluster_info
+    struct cluster_pt *pts;
+    int npts, pts_capacity;
+
+    struct ws_buffer grouped, offsets, refs;
+    int nrefs;
+    bool failed; // set if the frame's points could not be allocated
+};
+
+// One partition of the cluster ids, merged across the lists of all the
+// gradient cluster tasks (see gradient_clusters).
+struct cluster_merge_task
+{
+    struct cluster_map *maps;
+    int nmaps;
+    const int *starts, *ends; // the partition's part of each list
+    int *bounds; // nmaps+1 ints of scratch
+
+    // room for the partition's refs, twice over.
+    struct cluster_ref *refs, *tmp;
+    int nrefs;
+
+    struct cluster_ref *merged; // refs or tmp, sorted by id
+    int nclusters, nsplit;
+
+    // where the clusters go, and the points of those that were split.
+    zarray_t *headers;
+    struct pt *split_pts;
+};
+
+// The line fit between two of the maxima of quad_segment_maxima.
+struct segment_fit
+{
+    double err;
+    double nx, ny; // the normal of the line
+    bool ok;       // is the line fit good enough to be an edge?
+};
+
+// The buffers fit_quad needs for one cluster, reused for the next
+// cluster of the same quad task (and between frames).
+struct fit_quad_scratch
+{
+    struct ws_buffer keys, sort_tmp, pts;
+    struct ws_buffer lfps;
+    struct ws_buffer errs, filtered, filter, maxima, maxima_errs, sorted_errs;
+    struct ws_buffer segment_fits;
+};
+
+// Everything a frame needs that is large enough to be worth keeping
+// between frames, so that detecting on a stream of images of the same
+// size does not allocate it every frame. Owned by the detector (see
+// apriltag_workspace_get); not safe to share between detections that
+// run at the same time, like the rest of the detector.
+struct apriltag_workspace
+{
+    image_u8_t *decim; // the decimated input image
+
+    struct thresh_image threshim;
+    struct ws_buffer valid, polarity, row_runs, runs;
+
+    struct ws_buffer threshold_tasks, threshold_scratch;
+    struct ws_buffer sum, sumsq, local_mean_tasks, local_mean_rows;
+
+    unionfind_t *uf;
+    struct ws_buffer bands, unionfind_tasks;
+    zarray_t **linked; // one per stitching task
+    int nlinked;
+
+    struct ws_buffer cluster_tasks;
+    struct cluster_map *cluster_maps; // one per gradient cluster task
+    int ncluster_maps;
+    struct ws_buffer cluster_refs[2], cluster_bounds, cluster_sample, cluster_merge_tasks;
+    struct ws_buffer cluster_pts, cluster_headers; // see gradient_clusters
+
+    struct ws_buffer quad_tasks;
+    zarray_t **task_quads; // one per quad task
+    int ntask_quads;
+    struct fit_quad_scratch *quad_scratch; // one per quad task
+    int nquad_scratch;
+
+    // the time per item of each stage, in microseconds, smoothed over
+    // the frames. See apriltag_task_chunksize.
+    double stage_cost[APRILTAG_NSTAGES];
 };
 
 struct remove_vertex
@@ -159,12 +368,6 @@ struct line_fit_pt
     double W; // total weight
 };
 
-struct cluster_hash
-{
-    uint32_t hash;
-    uint64_t id;
-    zarray_t* data;
-};
 
 
 // lfps contains *cumulative* moments for N points, with
@@ -292,10 +495,6 @@ void fit_line(struct line_fit_pt *lfps, int sz, int i0, int i1, double *lineparm
         *mse = eig_small;
 }
 
-float pt_compare_angle(struct pt *a, struct pt *b) {
-    return a->slope - b->slope;
-}
-
 int err_compare_descending(const void *_a, const void *_b)
 {
     const double *a =  _a;
@@ -320,7 +519,8 @@ int err_compare_descending(const void *_a, const void *_b)
   rather than pairs of clusters.) Critically, this helps keep nearby
   edges from becoming connected.
 */
-int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_fit_pt *lfps, int indices[4])
+int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_fit_pt *lfps,
+                        struct fit_quad_scratch *scratch, int indices[4])
 {
     int sz = zarray_size(cluster);
 
@@ -341,16 +541,21 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
     if (ksz < 2)
         return 0;
 
-    double *errs = malloc(sizeof(double)*sz);
+    double *errs = ws_reserve(&scratch->errs, sizeof(double)*sz);
+    if (!errs)
+        return 0;
 
     for (int i = 0; i < sz; i++) {
-        fit_line(lfps, sz, (i + sz - ksz) % sz, (i + ksz) % sz, NULL, &errs[i], NULL);
+        int i0 = i - ksz, i1 = i + ksz;
+        if (i0 < 0)
+            i0 += sz;
+        if (i1 >= sz)
+            i1 -= sz;
+        fit_line(lfps, sz, i0, i1, NULL, &errs[i], NULL);
     }
 
     // apply a low-pass filter to errs
     if (1) {
-        double *y = malloc(sizeof(double)*sz);
-
         // how much filter to apply?
 
         // XXX Tunable
@@ -371,29 +576,37 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
 
         // For default values of cutoff = 0.05, sigma = 3,
         // we have fsz = 17.
-        float *f = malloc(sizeof(float)*fsz);
+        float *f = ws_reserve(&scratch->filter, sizeof(float)*fsz);
+        if (!f)
+            return 0;
 
         for (int i = 0; i < fsz; i++) {
             int j = i - fsz / 2;
             f[i] = exp(-j*j/(2*sigma*sigma));
         }
 
+        // errs, wrapped around by fsz/2 on either side, so that the
+        // filter does not need to.
+        double *x = ws_reserve(&scratch->filtered, sizeof(double)*(sz + fsz));
+        if (!x)
+            return 0;
+        for (int i = 0; i < sz + fsz - 1; i++)
+            x[i] = errs[(i - fsz / 2 + sz) % sz];
+
         for (int iy = 0; iy < sz; iy++) {
             double acc = 0;
 
             for (int i = 0; i < fsz; i++) {
-                acc += errs[(iy + i - fsz / 2 + sz) % sz] * f[i];
+                acc += x[iy + i] * f[i];
             }
-            y[iy] = acc;
+            errs[iy] = acc;
         }
-
-        memcpy(errs, y, sizeof(double)*sz);
-        free(y);
-        free(f);
     }
 
-    int *maxima = malloc(sizeof(int)*sz);
-    double *maxima_errs = malloc(sizeof(double)*sz);
+    int *maxima = ws_reserve(&scratch->maxima, sizeof(int)*sz);
+    double *maxima_errs = ws_reserve(&scratch->maxima_errs, sizeof(double)*sz);
+    if (!maxima || !maxima_errs)
+        return 0;
     int nmaxima = 0;
 
     for (int i = 0; i < sz; i++) {
@@ -403,12 +616,9 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
             nmaxima++;
         }
     }
-    free(errs);
 
     // if we didn't get at least 4 maxima, we can't fit a quad.
     if (nmaxima < 4){
-        free(maxima);
-        free(maxima_errs);
         return 0;
     }
 
@@ -416,7 +626,9 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
     int max_nmaxima = td->qtp.max_nmaxima;
 
     if (nmaxima > max_nmaxima) {
-        double *maxima_errs_copy = malloc(sizeof(double)*nmaxima);
+        double *maxima_errs_copy = ws_reserve(&scratch->sorted_errs, sizeof(double)*nmaxima);
+        if (!maxima_errs_copy)
+            return 0;
         memcpy(maxima_errs_copy, maxima_errs, sizeof(double)*nmaxima);
 
         // throw out all but the best handful of maxima. Sorts descending.
@@ -430,68 +642,97 @@ int quad_segment_maxima(apriltag_detector_t *td, zarray_t *cluster, struct line_
             maxima[out++] = maxima[in];
         }
         nmaxima = out;
-        free(maxima_errs_copy);
     }
-    free(maxima_errs);
+
+    // fit a line between each pair of maxima up front, rather than
+    // for every combination they are part of. (m0, m1) with m0 < m1
+    // is the edge from m0 to m1, and (m1, m0) the one that wraps
+    // around from m1 to m0, as only the last edge of a quad does.
+    struct segment_fit *fits = ws_reserve(&scratch->segment_fits, sizeof(struct segment_fit)*nmaxima*nmaxima);
+    if (!fits)
+        return 0;
+
+    // the smallest errors of the edges that may be used. They bound
+    // the error of the edges of a quad not yet chosen, to skip the
+    // combinations that cannot be better than the best one so far.
+    double min_err = HUGE_VAL, min_err_wrap = HUGE_VAL;
+
+    for (int m0 = 0; m0 < nmaxima; m0++) {
+        for (int m1 = m0+1; m1 < nmaxima; m1++) {
+            struct segment_fit *fit = &fits[m0*nmaxima + m1];
+            double params[4], mse;
+
+            fit_line(lfps, sz, maxima[m0], maxima[m1], params, &fit->err, &mse);
+            fit->ok = !(mse > td->qtp.max_line_fit_mse);
+            fit->nx = params[2];
+            fit->ny = params[3];
+            if (fit->ok && fit->err < min_err)
+                min_err = fit->err;
+
+            if (m1 - m0 < 3)
+                continue;
+
+            fit = &fits[m1*nmaxima + m0];
+            fit_line(lfps, sz, maxima[m1], maxima[m0], NULL, &fit->err, &mse);
+            fit->ok = !(mse > td->qtp.max_line_fit_mse);
+            if (fit->ok && fit->err < min_err_wrap)
+                min_err_wrap = fit->err;
+        }
+    }
 
     int best_indices[4];
     double best_error = HUGE_VALF;
 
-    double err01, err12, err23, err30;
-    double mse01, mse12, mse23, mse30;
-    double params01[4], params12[4];
-
     // disallow quads where the angle is less than a critical value.
     double max_dot = td->qtp.cos_critical_rad; //25*M_PI/180);
 
+    // Floating-point addition is monotonic, so an error summed with
+    // lower bounds in place of some of its terms is still a lower
+    // bound, as long as the terms are added in the same order.
     for (int m0 = 0; m0 < nmaxima - 3; m0++) {
-        int i0 = maxima[m0];
-
         for (int m1 = m0+1; m1 < nmaxima - 2; m1++) {
-            int i1 = maxima[m1];
-
-            fit_line(lfps, sz, i0, i1, params01, &err01, &mse01);
+            const struct segment_fit *fit01 = &fits[m0*nmaxima + m1];
+            if (!fit01->ok)
+                continue;
 
-            if (mse01 > td->qtp.max_line_fit_mse)
+            if (fit01->err + min_err + min_err + min_err_wrap >= best_error)
                 continue;
 
             for (int m2 = m1+1; m2 < nmaxima - 1; m2++) {
-                int i2 = maxima[m2];
-
-                fit_line(lfps, sz, i1, i2, params12, &err12, &mse12);
-                if (mse12 > td->qtp.max_line_fit_mse)
+                const struct segment_fit *fit12 = &fits[m1*nmaxima + m2];
+                if (!fit12->ok)
                     continue;
 
-                double dot = params01[2]*params12[2] + params01[3]*params12[3];
+                double dot = fit01->nx*fit12->nx + fit01->ny*fit12->ny;
                 if (fabs(dot) > max_dot)
                     continue;
 
-                for (int m3 = m2+1; m3 < nmaxima; m3++) {
-                    int i3 = maxima[m3];
+                double err012 = fit01->err + fit12->err;
+                if (err012 + min_err + min_err_wrap >= best_error)
+                    continue;
 
-                    fit_line(lfps, sz, i2, i3, NULL, &err23, &mse23);
-                    if (mse23 > td->qtp.max_line_fit_mse)
+                for (int m3 = m2+1; m3 < nmaxima; m3++) {
+                    const struct segment_fit *fit23 = &fits[m2*nmaxima + m3];
+                    if (!fit23->ok)
                         continue;
 
-                    fit_line(lfps, sz, i3, i0, NULL, &err30, &mse30);
-                    if (mse30 > td->qtp.max_line_fit_mse)
+                    const struct segment_fit *fit30 = &fits[m3*nmaxima + m0];
+                    if (!fit30->ok)
                         continue;
 
-                    double err = err01 + err12 + err23 + err30;
+                    double err = err012 + fit23->err + fit30->err;
                     if (err < best_error) {
                         best_error = err;
-                        best_indices[0] = i0;
-                        best_indices[1] = i1;
-                        best_indices[2] = i2;
-                        best_indices[3] = i3;
+                        best_indices[0] = maxima[m0];
+                        best_indices[1] = maxima[m1];
+                        best_indices[2] = maxima[m2];
+                        best_indices[3] = maxima[m3];
                     }
                 }
             }
         }
     }
 
-    free(maxima);
-
     if (best_error == HUGE_VALF)
         return 0;
 
@@ -617,9 +858,9 @@ int quad_segment_agg(zarray_t *cluster, struct line_fit_pt *lfps, int indices[4]
 /**
  * Compute statistics that allow line fit queries to be
  * efficiently computed for any contiguous range of indices.
+ * Fills (and returns) lfps, which has room for sz entries.
  */
-struct line_fit_pt* compute_lfps(int sz, zarray_t* cluster, image_u8_t* im) {
-    struct line_fit_pt *lfps = calloc(sz, sizeof(struct line_fit_pt));
+struct line_fit_pt* compute_lfps(int sz, zarray_t* cluster, image_u8_t* im, struct line_fit_pt *lfps) {
     double sum_Mx = 0, sum_My = 0, sum_Mxx = 0, sum_Myy = 0, sum_Mxy = 0, sum_W = 0;
 
     for (int i = 0; i < sz; i++) {
@@ -644,6 +885,10 @@ struct line_fit_pt* compute_lfps(int sz, zarray_t* cluster, image_u8_t* im) {
             W = sqrt(grad_x*grad_x + grad_y*grad_y) + 1;
         }
 
+        // an aggregated point weighs as much as the points it stands
+        // for.
+        W *= p->n;
+
         double fx = x, fy = y;
         sum_Mx  += W * fx;
         sum_My  += W * fy;
@@ -663,87 +908,79 @@ struct line_fit_pt* compute_lfps(int sz, zarray_t* cluster, image_u8_t* im) {
     return lfps;
 }
 
-static inline void ptsort(struct pt *pts, int sz)
+// Sorts keys by slope, with a merge sort. Points with the same slope
+// end up in an order that depends on the sort, which the quads found
+// depend on in turn (a little), so it must not change. tmp must have
+// room for 2*sz + 32 keys.
+static void sort_pt_keys(struct pt_key *keys, int sz, struct pt_key *tmp)
 {
 #define MAYBE_SWAP(arr,apos,bpos)                                   \
-    if (pt_compare_angle(&(arr[apos]), &(arr[bpos])) > 0) {                        \
-        tmp = arr[apos]; arr[apos] = arr[bpos]; arr[bpos] = tmp;    \
+    if (arr[apos].slope > arr[bpos].slope) {                        \
+        t = arr[apos]; arr[apos] = arr[bpos]; arr[bpos] = t;        \
     };
 
+    struct pt_key t;
+
     if (sz <= 1)
         return;
 
     if (sz == 2) {
-        struct pt tmp;
-        MAYBE_SWAP(pts, 0, 1);
+        MAYBE_SWAP(keys, 0, 1);
         return;
     }
 
     // NB: Using less-branch-intensive sorting networks here on the
     // hunch that it's better for performance.
     if (sz == 3) { // 3 element bubble sort is optimal
-        struct pt tmp;
-        MAYBE_SWAP(pts, 0, 1);
-        MAYBE_SWAP(pts, 1, 2);
-        MAYBE_SWAP(pts, 0, 1);
+        MAYBE_SWAP(keys, 0, 1);
+        MAYBE_SWAP(keys, 1, 2);
+        MAYBE_SWAP(keys, 0, 1);
         return;
     }
 
     if (sz == 4) { // 4 element optimal sorting network.
-        struct pt tmp;
-        MAYBE_SWAP(pts, 0, 1); // sort each half, like a merge sort
-        MAYBE_SWAP(pts, 2, 3);
-        MAYBE_SWAP(pts, 0, 2); // minimum value is now at 0.
-        MAYBE_SWAP(pts, 1, 3); // maximum value is now at end.
-        MAYBE_SWAP(pts, 1, 2); // that only leaves the middle two.
+        MAYBE_SWAP(keys, 0, 1); // sort each half, like a merge sort
+        MAYBE_SWAP(keys, 2, 3);
+        MAYBE_SWAP(keys, 0, 2); // minimum value is now at 0.
+        MAYBE_SWAP(keys, 1, 3); // maximum value is now at end.
+        MAYBE_SWAP(keys, 1, 2); // that only leaves the middle two.
         return;
     }
     if (sz == 5) {
         // this 9-step swap is optimal for a sorting network, but two
         // steps slower than a generic sort.
-        struct pt tmp;
-        MAYBE_SWAP(pts, 0, 1); // sort each half (3+2), like a merge sort
-        MAYBE_SWAP(pts, 3, 4);
-        MAYBE_SWAP(pts, 1, 2);
-        MAYBE_SWAP(pts, 0, 1);
-        MAYBE_SWAP(pts, 0, 3); // minimum element now at 0
-        MAYBE_SWAP(pts, 2, 4); // maximum element now at end
-        MAYBE_SWAP(pts, 1, 2); // now resort the three elements 1-3.
-        MAYBE_SWAP(pts, 2, 3);
-        MAYBE_SWAP(pts, 1, 2);
+        MAYBE_SWAP(keys, 0, 1); // sort each half (3+2), like a merge sort
+        MAYBE_SWAP(keys, 3, 4);
+        MAYBE_SWAP(keys, 1, 2);
+        MAYBE_SWAP(keys, 0, 1);
+        MAYBE_SWAP(keys, 0, 3); // minimum element now at 0
+        MAYBE_SWAP(keys, 2, 4); // maximum element now at end
+        MAYBE_SWAP(keys, 1, 2); // now resort the three elements 1-3.
+        MAYBE_SWAP(keys, 2, 3);
+        MAYBE_SWAP(keys, 1, 2);
         return;
     }
 
 #undef MAYBE_SWAP
 
-    // a merge sort with temp storage.
-    // Use stack allocation for small arrays to avoid malloc overhead
-    #define STACK_BUFFER_SIZE 256
-    struct pt stack_buffer[STACK_BUFFER_SIZE];
-    struct pt *tmp;
-    const bool use_heap = sz > STACK_BUFFER_SIZE;
-    if (use_heap) {
-        tmp = malloc(sizeof(struct pt) * sz);
-    } else {
-        tmp = stack_buffer;
-    }
-
-    memcpy(tmp, pts, sizeof(struct pt) * sz);
+    // a merge sort, the halves being sorted in tmp (with the rest of
+    // tmp as their scratch).
+    memcpy(tmp, keys, sizeof(struct pt_key) * sz);
 
     int asz = sz/2;
     int bsz = sz - asz;
 
-    struct pt *as = &tmp[0];
-    struct pt *bs = &tmp[asz];
+    struct pt_key *as = &tmp[0];
+    struct pt_key *bs = &tmp[asz];
 
-    ptsort(as, asz);
-    ptsort(bs, bsz);
+    sort_pt_keys(as, asz, &tmp[sz]);
+    sort_pt_keys(bs, bsz, &tmp[sz]);
 
     #define MERGE(apos,bpos)                        \
-    if (pt_compare_angle(&(as[apos]), &(bs[bpos])) < 0)        \
-        pts[outpos++] = as[apos++];             \
-    else                                        \
-        pts[outpos++] = bs[bpos++];
+    if (as[apos].slope < bs[bpos].slope)            \
+        keys[outpos++] = as[apos++];                \
+    else                                            \
+        keys[outpos++] = bs[bpos++];
 
     int apos = 0, bpos = 0, outpos = 0;
     while (apos + 8 < asz && bpos + 8 < bsz) {
@@ -756,13 +993,9 @@ static inline void ptsort(struct pt *pts, int sz)
     }
 
     if (apos < asz)
-        memcpy(&pts[outpos], &as[apos], (asz-apos)*sizeof(struct pt));
+        memcpy(&keys[outpos], &as[apos], (asz-apos)*sizeof(struct pt_key));
     if (bpos < bsz)
-        memcpy(&pts[outpos], &bs[bpos], (bsz-bpos)*sizeof(struct pt));
-
-    if (use_heap) {
-        free(tmp);
-    }
+        memcpy(&keys[outpos], &bs[bpos], (bsz-bpos)*sizeof(struct pt_key));
 
 #undef MERGE
 }
@@ -775,7 +1008,8 @@ int fit_quad(
         struct quad *quad,
         int tag_width,
         bool normal_border,
-        bool reversed_border) {
+        bool reversed_border,
+        struct fit_quad_scratch *scratch) {
     int res = 0;
 
     /////////////////////////////////////////////////////////////
@@ -785,15 +1019,14 @@ int fit_quad(
 
     // compute a bounding box so that we can order the points
     // according to their angle WRT the center.
-    struct pt *p1;
-    zarray_get_volatile(cluster, 0, &p1);
-    uint16_t xmax = p1->x;
-    uint16_t xmin = p1->x;
-    uint16_t ymax = p1->y;
-    uint16_t ymin = p1->y;
-    for (int pidx = 1; pidx < zarray_size(cluster); pidx++) {
-        struct pt *p;
-        zarray_get_volatile(cluster, pidx, &p);
+    struct pt *pts = (struct pt*) cluster->data;
+    int sz = zarray_size(cluster);
+    uint16_t xmax = pts[0].x;
+    uint16_t xmin = pts[0].x;
+    uint16_t ymax = pts[0].y;
+    uint16_t ymin = pts[0].y;
+    for (int pidx = 1; pidx < sz; pidx++) {
+        struct pt *p = &pts[pidx];
 
         if (p->x > xmax) {
             xmax = p->x;
@@ -824,14 +1057,35 @@ int fit_quad(
 
     float quadrants[2][2] = {{-1*(2 << 15), 0}, {2*(2 << 15), 2 << 15}};
 
-    for (int pidx = 0; pidx < zarray_size(cluster); pidx++) {
-        struct pt *p;
-        zarray_get_volatile(cluster, pidx, &p);
+    for (int pidx = 0; pidx < sz; pidx++) {
+        float dx = pts[pidx].x - cx;
+        float dy = pts[pidx].y - cy;
+
+        dot += dx*pts[pidx].gx + dy*pts[pidx].gy;
+    }
 
-        float dx = p->x - cx;
-        float dy = p->y - cy;
+    // Ensure that the black border is inside the white border.
+    quad->reversed_border = dot < 0;
+    if (!reversed_border && quad->reversed_border) {
+        return 0;
+    }
+    if (!normal_border && !quad->reversed_border) {
+        return 0;
+    }
 
-        dot += dx*p->gx + dy*p->gy;
+    // we now sort the points according to theta. This is a prepatory
+    // step for segmenting them into four lines. Rather than the points
+    // themselves, their slopes are sorted, next to their indices.
+    struct pt_key *keys = ws_reserve(&scratch->keys, sizeof(struct pt_key)*sz);
+    struct pt_key *sort_tmp = ws_reserve(&scratch->sort_tmp, sizeof(struct pt_key)*(2*sz + 32));
+    struct pt *copy = ws_reserve(&scratch->pts, sizeof(struct pt)*sz);
+    struct line_fit_pt *lfps = ws_reserve(&scratch->lfps, sizeof(struct line_fit_pt)*sz);
+    if (!keys || !sort_tmp || !copy || !lfps)
+        goto finish;
+
+    for (int pidx = 0; pidx < sz; pidx++) {
+        float dx = pts[pidx].x - cx;
+        float dy = pts[pidx].y - cy;
 
         float quadrant = quadrants[dy > 0][dx > 0];
         if (dy < 0) {
@@ -844,30 +1098,21 @@ int fit_quad(
             dx = dy;
             dy = -tmp;
         }
-        p->slope = quadrant + dy/dx;
+        keys[pidx].slope = quadrant + dy/dx;
+        keys[pidx].index = pidx;
     }
 
-    // Ensure that the black border is inside the white border.
-    quad->reversed_border = dot < 0;
-    if (!reversed_border && quad->reversed_border) {
-        return 0;
-    }
-    if (!normal_border && !quad->reversed_border) {
-        return 0;
-    }
+    sort_pt_keys(keys, sz, sort_tmp);
 
-    // we now sort the points according to theta. This is a prepatory
-    // step for segmenting them into four lines.
-    if (1) {
-        ptsort((struct pt*) cluster->data, zarray_size(cluster));
-    }
+    memcpy(copy, pts, sizeof(struct pt)*sz);
+    for (int pidx = 0; pidx < sz; pidx++)
+        pts[pidx] = copy[keys[pidx].index];
 
-    int sz = zarray_size(cluster);
-    struct line_fit_pt *lfps = compute_lfps(sz, cluster, im);
+    lfps = compute_lfps(sz, cluster, im, lfps);
 
     int indices[4];
     if (1) {
-        if (!quad_segment_maxima(td, cluster, lfps, indices))
+        if (!quad_segment_maxima(td, cluster, lfps, scratch, indices))
             goto finish;
     } else {
         if (!quad_segment_agg(cluster, lfps, indices))
@@ -989,76 +1234,231 @@ int fit_quad(
 
   finish:
 
-    free(lfps);
-
     return res;
 }
 
-#define DO_UNIONFIND2(dx, dy) if (im->buf[(y + dy)*s + x + dx] == v) unionfind_connect(uf, y*w + x, (y + dy)*w + x + dx);
+// The run detection and gradient scans below walk the packed
+// thresholded image a word (64 pixels) at a time. Each neighbor test
+// of a per-pixel scan becomes a mask of the pixels passing it,
+// computed with bitwise operations, and only pixels with some bit set
+// are visited, in increasing x.
+
+// the bits of the pixels to the left (resp. right) of those of word i.
+static inline uint64_t bits_left(const uint64_t *row, int i)
+{
+    return (row[i] << 1) | (i > 0 ? row[i - 1] >> 63 : 0);
+}
+
+static inline uint64_t bits_right(const uint64_t *row, int i)
+{
+    // rows are padded, so row[i + 1] exists.
+    return (row[i] >> 1) | (row[i + 1] << 63);
+}
+
+// pixels 1 <= x < w - 1 of word i. The first and last pixels of each
+// row are never the reference pixel.
+static inline uint64_t reference_mask(int w, int i)
+{
+    uint64_t mask = ~(uint64_t) 0;
+    if (i == 0)
+        mask &= ~(uint64_t) 1;
+    if ((w - 1) / 64 == i)
+        mask &= ((uint64_t) 1 << ((w - 1) & 63)) - 1;
+    return mask;
+}
+
+// pixels of word i which differ from their left neighbor, or which
+// must start a run anyway. Runs never extend to the last pixel of the
+// row: the pixel-wise union-find this replaces never joined it to its
+// left neighbor, so it is kept as a run of its own.
+static inline uint64_t run_boundaries(const struct thresh_image *im, const uint64_t *valid,
+                                      const uint64_t *polarity, int i)
+{
+    uint64_t b = (valid[i] ^ bits_left(valid, i)) | (polarity[i] ^ bits_left(polarity, i));
+    if ((im->width - 1) / 64 == i)
+        b |= (uint64_t) 1 << ((im->width - 1) & 63);
+    return b;
+}
 
-static void do_unionfind_first_line(unionfind_t *uf, image_u8_t *im, int w, int s)
+// Finds the runs of row y, and stores them unless runs is NULL.
+// Returns the number of runs.
+static int thresh_row_runs(const struct thresh_image *im, int y, struct thresh_run *runs)
 {
-    int y = 0;
-    uint8_t v;
+    const uint64_t *valid = &im->valid[y*im->stride];
+    const uint64_t *polarity = &im->polarity[y*im->stride];
+    int nwords = (im->width + 63) / 64;
 
-    for (int x = 1; x < w - 1; x++) {
-        v = im->buf[y*s + x];
+    int nstarts = 0, nends = 0;
+    uint64_t next = run_boundaries(im, valid, polarity, 0);
 
-        if (v == 127)
+    for (int i = 0; i < nwords; i++) {
+        uint64_t b = next;
+        next = run_boundaries(im, valid, polarity, i + 1);
+
+        uint64_t starts = valid[i] & b;
+        if (runs == NULL) {
+            nstarts += simd_popcount64(starts);
             continue;
+        }
 
-        DO_UNIONFIND2(-1, 0);
+        // the last pixel of each run is followed by a boundary. Since
+        // runs don't overlap, starts and ends alternate.
+        uint64_t ends = valid[i] & ((b >> 1) | (next << 63));
+
+        while (starts) {
+            int bit = simd_ctz64(starts);
+            starts &= starts - 1;
+            runs[nstarts].x0 = 64*i + bit;
+            runs[nstarts].white = (polarity[i] >> bit) & 1;
+            nstarts++;
+        }
+        while (ends) {
+            runs[nends++].x1 = 64*i + simd_ctz64(ends);
+            ends &= ends - 1;
+        }
     }
+
+    return nstarts;
 }
 
-static void do_unionfind_line2(unionfind_t *uf, image_u8_t *im, int w, int s, int y)
+// Joins the runs of row y to those of the row above. This connects
+// the same pixels as a per-pixel scan in which each pixel x in
+// [1, w-1) is joined to its left and upper neighbors of the same
+// color, and white pixels also to their diagonal upper neighbors
+// (4-connectivity for black, 8-connectivity for white). In addition,
+// the last pixel of a row is only joined to a white pixel below and
+// to its left if the pixel above that one is not white.
+//
+// If linked is not NULL, the unions are concurrent ones, and the
+// roots they link are appended to it.
+static void do_unionfind_line2(unionfind_t *uf, struct thresh_image *im, int w, int y, zarray_t *linked)
 {
     assert(y > 0);
 
-    uint8_t v_m1_m1;
-    uint8_t v_0_m1 = im->buf[(y - 1)*s];
-    uint8_t v_1_m1 = im->buf[(y - 1)*s + 1];
-    uint8_t v_m1_0;
-    uint8_t v = im->buf[y*s];
-
-    for (int x = 1; x < w - 1; x++) {
-        v_m1_m1 = v_0_m1;
-        v_0_m1 = v_1_m1;
-        v_1_m1 = im->buf[(y - 1)*s + x + 1];
-        v_m1_0 = v;
-        v = im->buf[y*s + x];
+    uint32_t a0 = im->row_runs[y], a1 = im->row_runs[y + 1];
+    uint32_t b0 = im->row_runs[y - 1], b1 = im->row_runs[y];
+    const struct thresh_run *runs = im->runs;
 
-        if (v == 127)
+    uint32_t b = b0;
+    for (uint32_t a = a0; a < a1; a++) {
+        // the pixels of this run which look for neighbors.
+        int lo = imax(runs[a].x0, 1), hi = imin(runs[a].x1, w - 2);
+        if (lo > hi)
             continue;
 
-        // (dx,dy) pairs for 8 connectivity:
-        // (-1, -1)    (0, -1)    (1, -1)
-        // (-1, 0)    (REFERENCE)
-        DO_UNIONFIND2(-1, 0);
+        while (b < b1 && runs[b].x1 + 1 < lo)
+            b++;
 
-        if (x == 1 || !((v_m1_0 == v_m1_m1) && (v_m1_m1 == v_0_m1))) {
-            DO_UNIONFIND2(0, -1);
-        }
+        for (uint32_t c = b; c < b1 && runs[c].x0 <= hi + 1; c++) {
+            if (runs[c].white != runs[a].white)
+                continue;
 
-        if (v == 255) {
-            if (x == 1 || !(v_m1_0 == v_m1_m1 || v_0_m1 == v_m1_m1) ) {
-                DO_UNIONFIND2(-1, -1);
-            }
-            if (!(v_0_m1 == v_1_m1)) {
-                DO_UNIONFIND2(1, -1);
+            bool connected;
+            if (!runs[a].white)
+                connected = imax(lo, runs[c].x0) <= imin(hi, runs[c].x1);
+            else if (runs[c].x0 == w - 1)
+                connected = hi == w - 2 && !(c > b0 && runs[c - 1].x1 == w - 2 && runs[c - 1].white);
+            else
+                connected = imax(lo, runs[c].x0 - 1) <= imin(hi, runs[c].x1 + 1);
+
+            if (!connected)
+                continue;
+
+            if (linked == NULL) {
+                unionfind_connect(uf, a, c);
+            } else {
+                uint32_t root = unionfind_connect_concurrent(uf, a, c);
+                if (root != 0xffffffff)
+                    zarray_add(linked, &root);
             }
         }
     }
 }
-#undef DO_UNIONFIND2
+
+static void do_count_runs_task(void *p)
+{
+    struct unionfind_task *task = (struct unionfind_task*) p;
+
+    for (int y = task->y0; y < task->y1; y++)
+        task->im->row_runs[y + 1] = thresh_row_runs(task->im, y, NULL);
+}
+
+// Stores the runs and initializes their sizes in the union-find, so
+// that set sizes are counted in pixels.
+static void do_fill_runs_task(void *p)
+{
+    struct unionfind_task *task = (struct unionfind_task*) p;
+    struct thresh_image *im = task->im;
+
+    for (int y = task->y0; y < task->y1; y++) {
+        uint32_t r0 = im->row_runs[y];
+        int n = thresh_row_runs(im, y, &im->runs[r0]);
+
+        for (int i = 0; i < n; i++)
+            task->uf->data[r0 + i].size = im->runs[r0 + i].x1 - im->runs[r0 + i].x0;
+    }
+}
 
 static void do_unionfind_task2(void *p)
 {
     struct unionfind_task *task = (struct unionfind_task*) p;
 
     for (int y = task->y0; y < task->y1; y++) {
-        do_unionfind_line2(task->uf, task->im, task->w, task->s, y);
+        do_unionfind_line2(task->uf, task->im, task->w, y, NULL);
+    }
+}
+
+// Joins row y0-1, which no task processed, to the row above it. The
+// rows on both sides belong to other tasks' trees, and the neighboring
+// stitching tasks may reach the same trees, so this uses concurrent
+// unions.
+static void do_stitch_task(void *p)
+{
+    struct unionfind_task *task = (struct unionfind_task*) p;
+
+    do_unionfind_line2(task->uf, task->im, task->w, task->y0 - 1, task->linked);
+}
+
+// Returns false if the cluster fails one of the cheap tests of
+// qtp->cluster_max_aspect, cluster_min_direction and
+// cluster_max_density, which need only a pass over its points.
+static bool cluster_prefilter(const struct apriltag_quad_thresh_params *qtp, zarray_t *cluster)
+{
+    if (qtp->cluster_max_aspect <= 0 && qtp->cluster_min_direction <= 0 && qtp->cluster_max_density <= 0)
+        return true;
+
+    const struct pt *pts = (const struct pt*) cluster->data;
+    int sz = zarray_size(cluster);
+
+    int xmin = pts[0].x, xmax = pts[0].x, ymin = pts[0].y, ymax = pts[0].y;
+    // how many gradients point right, left, down and up.
+    int ndir[4] = { 0, 0, 0, 0 };
+    for (int i = 0; i < sz; i++) {
+        xmin = imin(xmin, pts[i].x);
+        xmax = imax(xmax, pts[i].x);
+        ymin = imin(ymin, pts[i].y);
+        ymax = imax(ymax, pts[i].y);
+
+        ndir[0] += pts[i].gx > 0;
+        ndir[1] += pts[i].gx < 0;
+        ndir[2] += pts[i].gy > 0;
+        ndir[3] += pts[i].gy < 0;
     }
+
+    // in half pixels, so w + h is the perimeter in pixels.
+    int w = xmax - xmin, h = ymax - ymin;
+
+    if (qtp->cluster_max_aspect > 0 && imax(w, h) > qtp->cluster_max_aspect * imax(imin(w, h), 1))
+        return false;
+
+    if (qtp->cluster_max_density > 0 && sz > qtp->cluster_max_density * (w + h))
+        return false;
+
+    if (qtp->cluster_min_direction > 0 &&
+        imin(imin(ndir[0], ndir[1]), imin(ndir[2], ndir[3])) < qtp->cluster_min_direction * sz)
+        return false;
+
+    return true;
 }
 
 static void do_quad_task(void *p)
@@ -1088,27 +1488,241 @@ static void do_quad_task(void *p)
             continue;
         }
 
+        if (!cluster_prefilter(&td->qtp, *cluster))
+            continue;
+
         struct quad quad;
         memset(&quad, 0, sizeof(struct quad));
 
-        if (fit_quad(td, task->im, *cluster, &quad, task->tag_width, task->normal_border, task->reversed_border)) {
-            pthread_mutex_lock(&td->mutex);
+        if (fit_quad(td, task->im, *cluster, &quad, task->tag_width, task->normal_border, task->reversed_border,
+                     task->scratch)) {
             zarray_add(quads, &quad);
-            pthread_mutex_unlock(&td->mutex);
         }
     }
 }
 
-void do_minmax_task(void *p)
+// Returns the workspace of td, creating it on first use, or NULL if
+// it cannot be allocated.
+struct apriltag_workspace *apriltag_workspace_get(apriltag_detector_t *td)
 {
-    const int tilesz = 4;
-    struct minmax_task* task = (struct minmax_task*) p;
-    int s = task->im->stride;
-    int ty = task->ty;
-    int tw = task->im->width / tilesz;
-    image_u8_t *im = task->im;
+    if (td->ws == NULL) {
+        struct apriltag_workspace *ws = calloc(1, sizeof(struct apriltag_workspace));
+        if (ws != NULL)
+            ws->uf = unionfind_create(0);
+        if (ws == NULL || ws->uf == NULL) {
+            debug_print("Memory allocation failed\n");
+            free(ws);
+            return NULL;
+        }
+        td->ws = ws;
+    }
+    return td->ws;
+}
 
-    for (int tx = 0; tx < tw; tx++) {
+// Returns how many of the nitems items of stage each task should
+// take. The tasks are made long enough to be worth scheduling, given
+// the time per item measured in the previous frames, and otherwise
+// as many as APRILTAG_TASKS_PER_THREAD_TARGET per thread, to balance
+// the load. Running single threaded, there is only one.
+int apriltag_task_chunksize(apriltag_detector_t *td, enum apriltag_stage stage, int nitems)
+{
+    if (nitems <= 0)
+        return 1;
+    if (td->nthreads <= 1)
+        return nitems;
+
+    int ntasks = APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads;
+
+    struct apriltag_workspace *ws = apriltag_workspace_get(td);
+    double cost = ws ? ws->stage_cost[stage] : 0;
+    if (cost > 0) {
+        double n = nitems * cost / APRILTAG_MIN_TASK_USEC;
+        if (n < ntasks)
+            ntasks = n < 1 ? 1 : (int) n;
+    }
+
+    return (nitems + ntasks - 1) / ntasks;
+}
+
+// Records the time per item of stage, whose ntasks tasks processing
+// nitems items were added at utime0 and are done.
+void apriltag_task_timing(apriltag_detector_t *td, enum apriltag_stage stage, int nitems, int ntasks, int64_t utime0)
+{
+    struct apriltag_workspace *ws = apriltag_workspace_get(td);
+    if (td->nthreads <= 1 || nitems <= 0 || !ws)
+        return;
+
+    // only the elapsed time is known: count it for every thread that
+    // could have been busy. (A stage too short to be timed counts as
+    // one microsecond.) On a pool shared with other detectors (see
+    // apriltag_detector_set_workerpool) that time includes their
+    // tasks, so the cost comes out too high and tasks too large.
+    int64_t elapsed = imax(1, utime_now() - utime0);
+    double cost = (double) elapsed * imin(td->nthreads, ntasks) / nitems;
+
+    double *stage_cost = &ws->stage_cost[stage];
+    *stage_cost = *stage_cost > 0 ? 0.5 * (*stage_cost + cost) : cost;
+}
+
+void apriltag_workspace_destroy(struct apriltag_workspace *ws)
+{
+    if (ws == NULL)
+        return;
+
+    if (ws->decim != NULL)
+        image_u8_destroy(ws->decim);
+
+    struct ws_buffer *buffers[] = {
+        &ws->valid, &ws->polarity, &ws->row_runs, &ws->runs,
+        &ws->threshold_tasks, &ws->threshold_scratch,
+        &ws->sum, &ws->sumsq, &ws->local_mean_tasks, &ws->local_mean_rows,
+        &ws->bands, &ws->unionfind_tasks,
+        &ws->cluster_tasks, &ws->cluster_refs[0], &ws->cluster_refs[1],
+        &ws->cluster_bounds, &ws->cluster_sample, &ws->cluster_merge_tasks,
+        &ws->cluster_pts, &ws->cluster_headers,
+        &ws->quad_tasks };
+    for (int i = 0; i < (int) (sizeof(buffers) / sizeof(buffers[0])); i++)
+        ws_buffer_free(buffers[i]);
+
+    unionfind_destroy(ws->uf);
+
+    for (int i = 0; i < ws->nlinked; i++)
+        zarray_destroy(ws->linked[i]);
+    free(ws->linked);
+
+    for (int i = 0; i < ws->ncluster_maps; i++) {
+        struct cluster_map *map = &ws->cluster_maps[i];
+        free(map->slots);
+        zarray_destroy(map->info);
+        free(map->pts);
+        ws_buffer_free(&map->grouped);
+        ws_buffer_free(&map->offsets);
+        ws_buffer_free(&map->refs);
+    }
+    free(ws->cluster_maps);
+
+    for (int i = 0; i < ws->nquad_scratch; i++) {
+        struct fit_quad_scratch *scratch = &ws->quad_scratch[i];
+        struct ws_buffer *scratch_buffers[] = {
+            &scratch->keys, &scratch->sort_tmp, &scratch->pts, &scratch->lfps,
+            &scratch->errs, &scratch->filtered, &scratch->filter,
+            &scratch->maxima, &scratch->maxima_errs, &scratch->sorted_errs,
+            &scratch->segment_fits };
+        for (int j = 0; j < (int) (sizeof(scratch_buffers) / sizeof(scratch_buffers[0])); j++)
+            ws_buffer_free(scratch_buffers[j]);
+    }
+    free(ws->quad_scratch);
+
+    for (int i = 0; i < ws->ntask_quads; i++)
+        zarray_destroy(ws->task_quads[i]);
+    free(ws->task_quads);
+
+    free(ws);
+}
+
+// Decimates im into the image kept in the workspace of td. Returns
+// NULL if that cannot be allocated.
+image_u8_t *apriltag_workspace_decimate(apriltag_detector_t *td, image_u8_t *im, float factor)
+{
+    struct apriltag_workspace *ws = apriltag_workspace_get(td);
+    if (!ws)
+        return NULL;
+    ws->decim = image_u8_decimate_reuse(im, factor, ws->decim);
+    return ws->decim;
+}
+
+// Readies the thresholded image of the workspace for a width x height
+// frame. Thresholding writes every word of every row except for the
+// padding, which is cleared here. Returns NULL if the image cannot
+// be allocated.
+static struct thresh_image *thresh_image_reset(struct apriltag_workspace *ws, int width, int height)
+{
+    if (!ws)
+        return NULL;
+
+    struct thresh_image *ti = &ws->threshim;
+    ti->width = width;
+    ti->height = height;
+    ti->stride = (width + 63) / 64 + 1;
+
+    size_t sz = sizeof(uint64_t)*ti->stride*height;
+    ti->valid = ws_reserve(&ws->valid, sz);
+    ti->polarity = ws_reserve(&ws->polarity, sz);
+    if (!ti->valid || !ti->polarity)
+        return NULL;
+    for (int y = 0; y < height; y++) {
+        ti->valid[y*ti->stride + ti->stride - 1] = 0;
+        ti->polarity[y*ti->stride + ti->stride - 1] = 0;
+    }
+
+    ti->row_runs = NULL;
+    ti->runs = NULL;
+    return ti;
+}
+
+// Packs row y from its 0/127/255 pixels.
+static void thresh_image_pack_row(struct thresh_image *ti, int y, const uint8_t *row)
+{
+    uint64_t *valid = &ti->valid[y*ti->stride];
+    uint64_t *polarity = &ti->polarity[y*ti->stride];
+    int w = ti->width;
+
+    int x = 0;
+#ifdef APRILTAG_HAVE_V16
+    const v16u8 gray = v16_dup(127), white = v16_dup(255);
+    for (; x + 64 <= w; x += 64) {
+        uint64_t low = 0, pol = 0;
+        for (int i = 0; i < 4; i++) {
+            v16u8 v = v16_load(&row[x + 16*i]);
+            low |= (uint64_t) v16_movemask(v16_eq(v, gray)) << (16*i);
+            pol |= (uint64_t) v16_movemask(v16_eq(v, white)) << (16*i);
+        }
+        valid[x / 64] = ~low;
+        polarity[x / 64] = pol;
+    }
+#endif
+    for (; x < w; x += 64) {
+        uint64_t val = 0, pol = 0;
+        for (int i = 0; i < 64 && x + i < w; i++) {
+            val |= (uint64_t) (row[x + i] != 127) << i;
+            pol |= (uint64_t) (row[x + i] == 255) << i;
+        }
+        valid[x / 64] = val;
+        polarity[x / 64] = pol;
+    }
+}
+
+static void thresh_image_unpack_row(const struct thresh_image *ti, int y, uint8_t *row)
+{
+    const uint64_t *valid = &ti->valid[y*ti->stride];
+    const uint64_t *polarity = &ti->polarity[y*ti->stride];
+
+    for (int x = 0; x < ti->width; x++) {
+        if (!((valid[x / 64] >> (x & 63)) & 1))
+            row[x] = 127;
+        else if ((polarity[x / 64] >> (x & 63)) & 1)
+            row[x] = 255;
+        else
+            row[x] = 0;
+    }
+}
+
+// The tile statistics and thresholding kernels below operate on one
+// row of tiles at a time. Each has a scalar reference version that
+// processes tiles [tx0, tx1); the vectorized versions handle as many
+// tiles as they can starting at tx0 and return the first tile they
+// did not process, leaving the remainder to the scalar version. All
+// versions produce bit-identical results. The vectorized versions are
+// specialized for the default tile size of THRESH_SIMD_TILESZ pixels;
+// other tile sizes only use the scalar versions.
+#define THRESH_SIMD_TILESZ 4
+
+static void tile_minmax_row_scalar(const image_u8_t *im, int tilesz, int ty, int tx0, int tx1,
+                                   uint8_t *im_max, uint8_t *im_min)
+{
+    int s = im->stride;
+
+    for (int tx = tx0; tx < tx1; tx++) {
         uint8_t max = 0, min = 255;
 
         for (int dy = 0; dy < tilesz; dy++) {
@@ -1123,71 +1737,59 @@ void do_minmax_task(void *p)
             }
         }
 
-        task->im_max[ty*tw+tx] = max;
-        task->im_min[ty*tw+tx] = min;
+        im_max[tx] = max;
+        im_min[tx] = min;
     }
 }
 
-void do_blur_task(void *p)
+// rows_max/rows_min point at the tile rows above, at and below the
+// row being blurred. Rows outside of the image are NULL.
+static void tile_blur_row_scalar(const uint8_t *rows_max[3], const uint8_t *rows_min[3], int tw,
+                                 int tx0, int tx1, uint8_t *out_max, uint8_t *out_min)
 {
-    const int tilesz = 4;
-    struct blur_task* task = (struct blur_task*) p;
-    int ty = task->ty;
-    int tw = task->im->width / tilesz;
-    int th = task->im->height / tilesz;
-    uint8_t *im_max = task->im_max;
-    uint8_t *im_min = task->im_min;
-
-    for (int tx = 0; tx < tw; tx++) {
+    for (int tx = tx0; tx < tx1; tx++) {
         uint8_t max = 0, min = 255;
 
-        for (int dy = -1; dy <= 1; dy++) {
-            if (ty+dy < 0 || ty+dy >= th)
+        for (int dy = 0; dy < 3; dy++) {
+            if (rows_max[dy] == NULL)
                 continue;
             for (int dx = -1; dx <= 1; dx++) {
                 if (tx+dx < 0 || tx+dx >= tw)
                     continue;
 
-                uint8_t m = im_max[(ty+dy)*tw+tx+dx];
+                uint8_t m = rows_max[dy][tx+dx];
                 if (m > max)
                     max = m;
-                m = im_min[(ty+dy)*tw+tx+dx];
+                m = rows_min[dy][tx+dx];
                 if (m < min)
                     min = m;
             }
         }
 
-        task->im_max_tmp[ty*tw + tx] = max;
-        task->im_min_tmp[ty*tw + tx] = min;
+        out_max[tx] = max;
+        out_min[tx] = min;
     }
 }
 
-void do_threshold_task(void *p)
+// The thresholding kernels write the tile row's pixels to out, which
+// has the same stride as im and starts at the tile row's first row.
+static void tile_threshold_row_scalar(const image_u8_t *im, uint8_t *out, int tilesz, int ty,
+                                      int tx0, int tx1, const uint8_t *im_max, const uint8_t *im_min,
+                                      int min_white_black_diff)
 {
-    const int tilesz = 4;
-    struct threshold_task* task = (struct threshold_task*) p;
-    int ty = task->ty;
-    int tw = task->im->width / tilesz;
-    int s = task->im->stride;
-    uint8_t *im_max = task->im_max;
-    uint8_t *im_min = task->im_min;
-    image_u8_t *im = task->im;
-    image_u8_t *threshim = task->threshim;
-    int min_white_black_diff = task->td->qtp.min_white_black_diff;
+    int s = im->stride;
 
-    for (int tx = 0; tx < tw; tx++) {
-        int min = im_min[ty*tw + tx];
-        int max = im_max[ty*tw + tx];
+    for (int tx = tx0; tx < tx1; tx++) {
+        int min = im_min[tx];
+        int max = im_max[tx];
 
         // low contrast region? (no edges)
         if (max - min < min_white_black_diff) {
             for (int dy = 0; dy < tilesz; dy++) {
-                int y = ty*tilesz + dy;
-
                 for (int dx = 0; dx < tilesz; dx++) {
                     int x = tx*tilesz + dx;
 
-                    threshim->buf[y*s+x] = 127;
+                    out[dy*s+x] = 127;
                 }
             }
             continue;
@@ -1207,152 +1809,661 @@ void do_threshold_task(void *p)
 
                 uint8_t v = im->buf[y*s+x];
                 if (v > thresh)
-                    threshim->buf[y*s+x] = 255;
+                    out[dy*s+x] = 255;
                 else
-                    threshim->buf[y*s+x] = 0;
+                    out[dy*s+x] = 0;
             }
         }
     }
 }
- 
-image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
+
+#ifdef APRILTAG_HAVE_V16
+// 16 pixels (four tiles) per iteration.
+static int tile_minmax_row_v16(const image_u8_t *im, int ty, int tx0, int tx1,
+                               uint8_t *im_max, uint8_t *im_min)
 {
-    int w = im->width, h = im->height, s = im->stride;
-    assert(w < 32768);
-    assert(h < 32768);
+    int s = im->stride;
+    const uint8_t *row = &im->buf[ty*THRESH_SIMD_TILESZ*s];
 
-    image_u8_t *threshim = image_u8_create_alignment(w, h, s);
-    assert(threshim->stride == s);
+    int tx = tx0;
+    for (; tx + 4 <= tx1; tx += 4) {
+        const uint8_t *p = &row[tx*THRESH_SIMD_TILESZ];
+        v16u8 r0 = v16_load(p), r1 = v16_load(p + s), r2 = v16_load(p + 2*s), r3 = v16_load(p + 3*s);
 
-    // The idea is to find the maximum and minimum values in a
-    // window around each pixel. If it's a contrast-free region
-    // (max-min is small), don't try to binarize. Otherwise,
-    // threshold according to (max+min)/2.
-    //
-    // Mark low-contrast regions with value 127 so that we can skip
-    // future work on these areas too.
+        v16u8 max = v16_max(v16_max(r0, r1), v16_max(r2, r3));
+        v16u8 min = v16_min(v16_min(r0, r1), v16_min(r2, r3));
 
-    // however, computing max/min around every pixel is needlessly
-    // expensive. We compute max/min for tiles. To avoid artifacts
-    // that arise when high-contrast features appear near a tile
-    // edge (and thus moving from one tile to another results in a
-    // large change in max/min value), the max/min values used for
-    // any pixel are computed from all 3x3 surrounding tiles. Thus,
-    // the max/min sampling area for nearby pixels overlap by at least
-    // one tile.
-    //
-    // The important thing is that the windows be large enough to
-    // capture edge transitions; the tag does not need to fit into
-    // a tile.
+        simd_store_u32(&im_max[tx], v16_hmax4(max));
+        simd_store_u32(&im_min[tx], v16_hmin4(min));
+    }
+    return tx;
+}
 
-    // XXX Tunable. Generally, small tile sizes--- so long as they're
-    // large enough to span a single tag edge--- seem to be a winner.
-    const int tilesz = 4;
+// Only handles interior tiles: tx0 must be at least 1, and a vector
+// is only processed if its right neighbors are inside the row.
+static int tile_blur_row_v16(const uint8_t *rows_max[3], const uint8_t *rows_min[3], int tw,
+                             int tx0, int tx1, uint8_t *out_max, uint8_t *out_min)
+{
+    int tx = tx0;
+    for (; tx + 16 < tw && tx + 16 <= tx1; tx += 16) {
+        v16u8 max = v16_dup(0), min = v16_dup(255);
+
+        for (int dy = 0; dy < 3; dy++) {
+            if (rows_max[dy] == NULL)
+                continue;
+            const uint8_t *pmax = &rows_max[dy][tx], *pmin = &rows_min[dy][tx];
+            max = v16_max(max, v16_max(v16_max(v16_load(pmax - 1), v16_load(pmax)), v16_load(pmax + 1)));
+            min = v16_min(min, v16_min(v16_min(v16_load(pmin - 1), v16_load(pmin)), v16_load(pmin + 1)));
+        }
+
+        v16_store(&out_max[tx], max);
+        v16_store(&out_min[tx], min);
+    }
+    return tx;
+}
+
+static int tile_threshold_row_v16(const image_u8_t *im, uint8_t *out, int ty, int tx0, int tx1,
+                                  const uint8_t *im_max, const uint8_t *im_min, int min_white_black_diff)
+{
+    // the low-contrast test is done in 8 bits, which covers every
+    // useful setting. Leave anything else to the scalar version.
+    if (min_white_black_diff < 1 || min_white_black_diff > 255)
+        return tx0;
+
+    int s = im->stride;
+    const uint8_t *row = &im->buf[ty*THRESH_SIMD_TILESZ*s];
+
+    const v16u8 lim = v16_dup(min_white_black_diff - 1);
+    const v16u8 gray = v16_dup(127);
+
+    int tx = tx0;
+    for (; tx + 4 <= tx1; tx += 4) {
+        v16u8 max = v16_expand4(simd_load_u32(&im_max[tx]));
+        v16u8 min = v16_expand4(simd_load_u32(&im_min[tx]));
+
+        v16u8 diff = v16_subs(max, min);
+        v16u8 thresh = v16_adds(min, v16_shr1(diff));
+        v16u8 low = v16_eq(v16_min(diff, lim), diff);
+        v16u8 fill = v16_and(low, gray);
+
+        for (int dy = 0; dy < THRESH_SIMD_TILESZ; dy++) {
+            v16u8 v = v16_load(&row[dy*s + tx*THRESH_SIMD_TILESZ]);
+            v16u8 bw = v16_gt(v, thresh);
+            v16_store(&out[dy*s + tx*THRESH_SIMD_TILESZ], v16_or(v16_andnot(low, bw), fill));
+        }
+    }
+    return tx;
+}
+#endif
+
+#ifdef APRILTAG_HAVE_AVX2_DISPATCH
+// 32 pixels (eight tiles) per iteration.
+__attribute__((target("avx2")))
+static int tile_minmax_row_avx2(const image_u8_t *im, int ty, int tx0, int tx1,
+                                uint8_t *im_max, uint8_t *im_min)
+{
+    int s = im->stride;
+    const uint8_t *row = &im->buf[ty*THRESH_SIMD_TILESZ*s];
+    const __m256i lo = _mm256_set1_epi32(0xff);
+
+    int tx = tx0;
+    for (; tx + 8 <= tx1; tx += 8) {
+        const uint8_t *p = &row[tx*THRESH_SIMD_TILESZ];
+        __m256i r0 = _mm256_loadu_si256((const __m256i*) p);
+        __m256i r1 = _mm256_loadu_si256((const __m256i*) (p + s));
+        __m256i r2 = _mm256_loadu_si256((const __m256i*) (p + 2*s));
+        __m256i r3 = _mm256_loadu_si256((const __m256i*) (p + 3*s));
+
+        __m256i max = _mm256_max_epu8(_mm256_max_epu8(r0, r1), _mm256_max_epu8(r2, r3));
+        __m256i min = _mm256_min_epu8(_mm256_min_epu8(r0, r1), _mm256_min_epu8(r2, r3));
+
+        // reduce each group of four bytes into the low byte of its dword
+        max = _mm256_max_epu8(max, _mm256_srli_epi32(max, 8));
+        max = _mm256_max_epu8(max, _mm256_srli_epi32(max, 16));
+        min = _mm256_min_epu8(min, _mm256_srli_epi32(min, 8));
+        min = _mm256_min_epu8(min, _mm256_srli_epi32(min, 16));
+
+        // pack dwords to bytes. This happens within each 128 bit lane.
+        __m256i mm = _mm256_packs_epi32(_mm256_and_si256(max, lo), _mm256_and_si256(min, lo));
+        mm = _mm256_packus_epi16(mm, mm);
+
+        __m128i l0 = _mm256_castsi256_si128(mm), l1 = _mm256_extracti128_si256(mm, 1);
+        simd_store_u32(&im_max[tx], (uint32_t) _mm_cvtsi128_si32(l0));
+        simd_store_u32(&im_max[tx + 4], (uint32_t) _mm_cvtsi128_si32(l1));
+        simd_store_u32(&im_min[tx], (uint32_t) _mm_cvtsi128_si32(_mm_srli_si128(l0, 4)));
+        simd_store_u32(&im_min[tx + 4], (uint32_t) _mm_cvtsi128_si32(_mm_srli_si128(l1, 4)));
+    }
+    return tx;
+}
+
+__attribute__((target("avx2")))
+static int tile_threshold_row_avx2(const image_u8_t *im, uint8_t *out, int ty, int tx0, int tx1,
+                                   const uint8_t *im_max, const uint8_t *im_min, int min_white_black_diff)
+{
+    if (min_white_black_diff < 1 || min_white_black_diff > 255)
+        return tx0;
+
+    int s = im->stride;
+    const uint8_t *row = &im->buf[ty*THRESH_SIMD_TILESZ*s];
+
+    const __m256i lim = _mm256_set1_epi8((char) (min_white_black_diff - 1));
+    const __m256i gray = _mm256_set1_epi8(127);
+    const __m256i bias = _mm256_set1_epi8((char) 0x80);
+    const __m256i m7f = _mm256_set1_epi8(0x7f);
+
+    int tx = tx0;
+    for (; tx + 8 <= tx1; tx += 8) {
+        // expand eight tile values to 32 pixels.
+        __m128i xmax = _mm_loadl_epi64((const __m128i*) &im_max[tx]);
+        __m128i xmin = _mm_loadl_epi64((const __m128i*) &im_min[tx]);
+        xmax = _mm_unpacklo_epi8(xmax, xmax);
+        xmin = _mm_unpacklo_epi8(xmin, xmin);
+        __m256i max = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(xmax, xmax)),
+                                              _mm_unpackhi_epi16(xmax, xmax), 1);
+        __m256i min = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(xmin, xmin)),
+                                              _mm_unpackhi_epi16(xmin, xmin), 1);
+
+        __m256i diff = _mm256_subs_epu8(max, min);
+        __m256i thresh = _mm256_adds_epu8(min, _mm256_and_si256(_mm256_srli_epi16(diff, 1), m7f));
+        __m256i low = _mm256_cmpeq_epi8(_mm256_min_epu8(diff, lim), diff);
+        __m256i fill = _mm256_and_si256(low, gray);
+        __m256i tb = _mm256_xor_si256(thresh, bias);
+
+        for (int dy = 0; dy < THRESH_SIMD_TILESZ; dy++) {
+            __m256i v = _mm256_loadu_si256((const __m256i*) &row[dy*s + tx*THRESH_SIMD_TILESZ]);
+            __m256i bw = _mm256_cmpgt_epi8(_mm256_xor_si256(v, bias), tb);
+            _mm256_storeu_si256((__m256i*) &out[dy*s + tx*THRESH_SIMD_TILESZ],
+                                _mm256_or_si256(_mm256_andnot_si256(low, bw), fill));
+        }
+    }
+    return tx;
+}
+#endif
+
+// Tile sizes other than THRESH_SIMD_TILESZ work on rows of per-column
+// (or per-pixel) values instead. The tile rows are first reduced
+// vertically, which vectorizes for any tile size, leaving only a single
+// row to reduce horizontally. rowbuf needs room for two image rows.
+static void tile_minmax_row_generic(const image_u8_t *im, int tilesz, int ty, int tw, uint8_t *rowbuf,
+                                    uint8_t *im_max, uint8_t *im_min)
+{
+    int s = im->stride;
+    int w = tw*tilesz;
+    const uint8_t *row = &im->buf[ty*tilesz*s];
+    uint8_t *colmax = rowbuf, *colmin = rowbuf + w;
+
+    int x = 0;
+#ifdef APRILTAG_HAVE_V16
+    for (; x + 16 <= w; x += 16) {
+        v16u8 max = v16_load(&row[x]), min = max;
+        for (int dy = 1; dy < tilesz; dy++) {
+            v16u8 v = v16_load(&row[dy*s + x]);
+            max = v16_max(max, v);
+            min = v16_min(min, v);
+        }
+        v16_store(&colmax[x], max);
+        v16_store(&colmin[x], min);
+    }
+#endif
+    for (; x < w; x++) {
+        uint8_t max = row[x], min = row[x];
+        for (int dy = 1; dy < tilesz; dy++) {
+            uint8_t v = row[dy*s + x];
+            if (v > max)
+                max = v;
+            if (v < min)
+                min = v;
+        }
+        colmax[x] = max;
+        colmin[x] = min;
+    }
+
+    for (int tx = 0; tx < tw; tx++) {
+        uint8_t max = 0, min = 255;
+        for (int dx = 0; dx < tilesz; dx++) {
+            if (colmax[tx*tilesz + dx] > max)
+                max = colmax[tx*tilesz + dx];
+            if (colmin[tx*tilesz + dx] < min)
+                min = colmin[tx*tilesz + dx];
+        }
+        im_max[tx] = max;
+        im_min[tx] = min;
+    }
+}
+
+// Expands the threshold and low contrast flag of each tile into a row
+// of pixels, which then applies to each of the tile row's pixel rows.
+static void tile_threshold_row_generic(const image_u8_t *im, uint8_t *out, int tilesz, int ty, int tw,
+                                       uint8_t *rowbuf, const uint8_t *im_max, const uint8_t *im_min,
+                                       int min_white_black_diff)
+{
+    int s = im->stride;
+    int w = tw*tilesz;
+    uint8_t *thresh = rowbuf, *low = rowbuf + w;
+
+    for (int tx = 0; tx < tw; tx++) {
+        int min = im_min[tx];
+        int max = im_max[tx];
+
+        memset(&thresh[tx*tilesz], min + (max - min) / 2, tilesz);
+        memset(&low[tx*tilesz], max - min < min_white_black_diff ? 0xff : 0, tilesz);
+    }
+
+    for (int dy = 0; dy < tilesz; dy++) {
+        const uint8_t *in = &im->buf[(ty*tilesz + dy)*s];
+        uint8_t *o = &out[dy*s];
+
+        int x = 0;
+#ifdef APRILTAG_HAVE_V16
+        const v16u8 gray = v16_dup(127);
+        for (; x + 16 <= w; x += 16) {
+            v16u8 l = v16_load(&low[x]);
+            v16u8 bw = v16_gt(v16_load(&in[x]), v16_load(&thresh[x]));
+            v16_store(&o[x], v16_or(v16_andnot(l, bw), v16_and(l, gray)));
+        }
+#endif
+        for (; x < w; x++) {
+            if (low[x])
+                o[x] = 127;
+            else
+                o[x] = in[x] > thresh[x] ? 255 : 0;
+        }
+    }
+}
+
+static void tile_minmax_row(const image_u8_t *im, int tilesz, int ty, int tw, uint8_t *rowbuf,
+                            uint8_t *im_max, uint8_t *im_min)
+{
+    if (tilesz != THRESH_SIMD_TILESZ) {
+        tile_minmax_row_generic(im, tilesz, ty, tw, rowbuf, im_max, im_min);
+        return;
+    }
+
+    int tx = 0;
+#ifdef APRILTAG_HAVE_AVX2_DISPATCH
+    if (simd_cpu_has_avx2())
+        tx = tile_minmax_row_avx2(im, ty, tx, tw, im_max, im_min);
+#endif
+#ifdef APRILTAG_HAVE_V16
+    tx = tile_minmax_row_v16(im, ty, tx, tw, im_max, im_min);
+#endif
+    tile_minmax_row_scalar(im, tilesz, ty, tx, tw, im_max, im_min);
+}
+
+static void tile_blur_row(const uint8_t *rows_max[3], const uint8_t *rows_min[3], int tw,
+                          uint8_t *out_max, uint8_t *out_min)
+{
+    int tx = imin(1, tw);
+    tile_blur_row_scalar(rows_max, rows_min, tw, 0, tx, out_max, out_min);
+#ifdef APRILTAG_HAVE_V16
+    tx = tile_blur_row_v16(rows_max, rows_min, tw, tx, tw, out_max, out_min);
+#endif
+    tile_blur_row_scalar(rows_max, rows_min, tw, tx, tw, out_max, out_min);
+}
+
+static void tile_threshold_row(const image_u8_t *im, uint8_t *out, int tilesz, int ty, int tw,
+                               uint8_t *rowbuf, const uint8_t *im_max, const uint8_t *im_min,
+                               int min_white_black_diff)
+{
+    if (tilesz != THRESH_SIMD_TILESZ) {
+        tile_threshold_row_generic(im, out, tilesz, ty, tw, rowbuf, im_max, im_min, min_white_black_diff);
+        return;
+    }
+
+    int tx = 0;
+#ifdef APRILTAG_HAVE_AVX2_DISPATCH
+    if (simd_cpu_has_avx2())
+        tx = tile_threshold_row_avx2(im, out, ty, tx, tw, im_max, im_min, min_white_black_diff);
+#endif
+#ifdef APRILTAG_HAVE_V16
+    tx = tile_threshold_row_v16(im, out, ty, tx, tw, im_max, im_min, min_white_black_diff);
+#endif
+    tile_threshold_row_scalar(im, out, tilesz, ty, tx, tw, im_max, im_min, min_white_black_diff);
+}
+
+// Threshold the pixels right of the last full tile in row y, or the
+// whole row if x0 == 0. These partial tiles use the statistics of the
+// nearest full tile and are never marked as low contrast.
+static void threshold_partial_row(const image_u8_t *im, uint8_t *out, int tilesz, int y, int x0, int tw,
+                                  const uint8_t *blur_max, const uint8_t *blur_min)
+{
+    int s = im->stride;
+
+    for (int x = x0; x < im->width; x++) {
+        int tx = x / tilesz;
+        if (tx >= tw)
+            tx = tw - 1;
+
+        int max = blur_max[tx];
+        int min = blur_min[tx];
+        int thresh = min + (max - min) / 2;
+
+        uint8_t v = im->buf[y*s+x];
+        if (v > thresh)
+            out[x] = 255;
+        else
+            out[x] = 0;
+    }
+}
+
+// Computes the tile statistics, blurs them and thresholds the pixels
+// for a band of tile rows in a single pass. The min/max of the tile
+// rows (one above and one below the band included) are kept in a
+// three-row ring buffer, so only a few rows of tile statistics are
+// ever live and the input rows are still in cache when they are
+// thresholded. Likewise, each tile row is thresholded into a small
+// buffer and packed from there.
+void do_threshold_task(void *p)
+{
+    struct threshold_task *task = (struct threshold_task*) p;
+    image_u8_t *im = task->im;
+    struct thresh_image *threshim = task->threshim;
+    int s = im->stride;
+    int tilesz = task->tilesz;
+    int tw = im->width / tilesz;
+    int th = im->height / tilesz;
+    int min_white_black_diff = task->td->qtp.min_white_black_diff;
+
+    uint8_t *ring_max = task->scratch;
+    uint8_t *ring_min = ring_max + 3*tw;
+    uint8_t *blur_max = ring_min + 3*tw;
+    uint8_t *blur_min = blur_max + tw;
+    uint8_t *rowbuf = blur_min + tw;
+    uint8_t *out = rowbuf + 2*tw*tilesz; // tilesz rows of stride s
+
+    int next_ty = imax(0, task->ty0 - 1); // next tile row to collect min/max for
+
+    for (int ty = task->ty0; ty < task->ty1; ty++) {
+        while (next_ty <= imin(ty + 1, th - 1)) {
+            tile_minmax_row(im, tilesz, next_ty, tw, rowbuf, &ring_max[(next_ty % 3)*tw], &ring_min[(next_ty % 3)*tw]);
+            next_ty++;
+        }
+
+        const uint8_t *rows_max[3], *rows_min[3];
+        for (int dy = -1; dy <= 1; dy++) {
+            if (ty+dy < 0 || ty+dy >= th) {
+                rows_max[dy+1] = NULL;
+                rows_min[dy+1] = NULL;
+            } else {
+                rows_max[dy+1] = &ring_max[((ty+dy) % 3)*tw];
+                rows_min[dy+1] = &ring_min[((ty+dy) % 3)*tw];
+            }
+        }
+
+        tile_blur_row(rows_max, rows_min, tw, blur_max, blur_min);
+
+        tile_threshold_row(im, out, tilesz, ty, tw, rowbuf, blur_max, blur_min, min_white_black_diff);
+
+        for (int dy = 0; dy < tilesz; dy++) {
+            threshold_partial_row(im, &out[dy*s], tilesz, ty*tilesz + dy, tw*tilesz, tw, blur_max, blur_min);
+            thresh_image_pack_row(threshim, ty*tilesz + dy, &out[dy*s]);
+        }
+    }
+
+    // the rows below the last full tile row use the last tile row's
+    // statistics, which are still in blur_max/blur_min.
+    if (task->ty1 == th) {
+        for (int y = th*tilesz; y < im->height; y++) {
+            threshold_partial_row(im, out, tilesz, y, 0, tw, blur_max, blur_min);
+            thresh_image_pack_row(threshim, y, out);
+        }
+    }
+}
+
+// returns non-zero if the tasks cannot be allocated.
+static int threshold_tiles(apriltag_detector_t *td, image_u8_t *im, struct thresh_image *threshim, int tilesz)
+{
+    int w = im->width, h = im->height, s = im->stride;
 
     // the last (possibly partial) tiles along each row and column will
     // just use the min/max value from the last full tile.
     int tw = w / tilesz;
     int th = h / tilesz;
 
-    uint8_t *im_max = calloc(tw*th, sizeof(uint8_t));
-    uint8_t *im_min = calloc(tw*th, sizeof(uint8_t));
+    // with no full tiles, there are no statistics to threshold with,
+    // and everything stays low contrast (not valid).
+    if (tw > 0 && th > 0) {
+        // each task handles a band of tile rows. The bands recompute
+        // the statistics of the tile rows bordering them, so don't
+        // split the image at all when running single threaded.
+        int64_t utime0 = utime_now();
+        int chunksize = apriltag_task_chunksize(td, APRILTAG_STAGE_THRESHOLD, th);
+        int ntasks = (th + chunksize - 1) / chunksize;
+
+        struct apriltag_workspace *ws = td->ws;
+        struct threshold_task *tasks = ws_reserve(&ws->threshold_tasks, sizeof(struct threshold_task)*ntasks);
+        // see do_threshold_task for the layout of the scratch space.
+        int scratchsz = 8*tw + 2*tw*tilesz + tilesz*s;
+        uint8_t *scratch = ws_reserve(&ws->threshold_scratch, (size_t) scratchsz*ntasks);
+        if (!tasks || !scratch)
+            return -1;
+
+        for (int i = 0; i < ntasks; i++) {
+            tasks[i].ty0 = i*chunksize;
+            tasks[i].ty1 = imin(th, (i+1)*chunksize);
+            tasks[i].tilesz = tilesz;
+            tasks[i].td = td;
+            tasks[i].im = im;
+            tasks[i].threshim = threshim;
+            tasks[i].scratch = &scratch[scratchsz*i];
+
+            workerpool_add_task(td->wp, do_threshold_task, &tasks[i]);
+        }
+        workerpool_run(td->wp);
 
-    struct minmax_task *minmax_tasks = malloc(sizeof(struct minmax_task)*th);
-    // first, collect min/max statistics for each tile
-    for (int ty = 0; ty < th; ty++) {
-        minmax_tasks[ty].im = im;
-        minmax_tasks[ty].im_max = im_max;
-        minmax_tasks[ty].im_min = im_min;
-        minmax_tasks[ty].ty = ty;
+        apriltag_task_timing(td, APRILTAG_STAGE_THRESHOLD, th, ntasks, utime0);
+    } else {
+        memset(threshim->valid, 0, sizeof(uint64_t)*threshim->stride*h);
+    }
+
+    return 0;
+}
+
+// Computes the prefix sums of the pixel values (and their squares)
+// along each row in [i0, i1).
+static void do_integral_rows_task(void *p)
+{
+    struct local_mean_task *task = (struct local_mean_task*) p;
+    image_u8_t *im = task->im;
+    int w = im->width, s = im->stride;
+
+    for (int y = task->i0; y < task->i1; y++) {
+        uint32_t *sum = &task->sum[(y+1)*(w+1)];
+        uint32_t *sumsq = &task->sumsq[(y+1)*(w+1)];
+        uint32_t acc = 0, accsq = 0;
+
+        sum[0] = 0;
+        sumsq[0] = 0;
+        for (int x = 0; x < w; x++) {
+            uint32_t v = im->buf[y*s+x];
+            acc += v;
+            accsq += v*v;
+            sum[x+1] = acc;
+            sumsq[x+1] = accsq;
+        }
+    }
+}
+
+// Accumulates the row prefix sums down the image columns [i0, i1),
+// i.e. the table columns [i0+1, i1+1); the first table column is all
+// zeros. Each task walks its strip of columns top to bottom.
+static void do_integral_cols_task(void *p)
+{
+    struct local_mean_task *task = (struct local_mean_task*) p;
+    int w = task->im->width, h = task->im->height;
 
-        workerpool_add_task(td->wp, do_minmax_task, &minmax_tasks[ty]);
+    for (int y = 2; y <= h; y++) {
+        uint32_t *sum = &task->sum[y*(w+1)];
+        uint32_t *sumsq = &task->sumsq[y*(w+1)];
+
+        for (int x = task->i0 + 1; x <= task->i1; x++) {
+            sum[x] += sum[x - (w+1)];
+            sumsq[x] += sumsq[x - (w+1)];
+        }
     }
-    workerpool_run(td->wp);
-    free(minmax_tasks);
+}
 
-    // second, apply 3x3 max/min convolution to "blur" these values
-    // over larger areas. This reduces artifacts due to abrupt changes
-    // in the threshold value.
-    if (1) {
-        uint8_t *im_max_tmp = calloc(tw*th, sizeof(uint8_t));
-        uint8_t *im_min_tmp = calloc(tw*th, sizeof(uint8_t));
+// Thresholds the rows [i0, i1) against the mean of the window of
+// (2r+1)x(2r+1) pixels around each pixel, clipped to the image. A
+// window whose standard deviation is below half of
+// min_white_black_diff is marked as low contrast, which matches the
+// tile criterion for a window containing equal amounts of two grey
+// levels.
+//
+// The tables are only correct modulo 2^32, but since no window can
+// contain more than 256x256 pixels its sums fit into 32 bits, so the
+// wrapped differences below are exact.
+static void do_local_mean_task(void *p)
+{
+    struct local_mean_task *task = (struct local_mean_task*) p;
+    image_u8_t *im = task->im;
+    int w = im->width, h = im->height, s = im->stride;
+    int r = task->r;
+
+    uint64_t diff = imax(0, imin(256, task->td->qtp.min_white_black_diff));
+    uint8_t *out = task->row;
+
+    for (int y = task->i0; y < task->i1; y++) {
+        int y0 = imax(0, y - r), y1 = imin(h, y + r + 1);
+        const uint32_t *sum0 = &task->sum[y0*(w+1)], *sum1 = &task->sum[y1*(w+1)];
+        const uint32_t *sumsq0 = &task->sumsq[y0*(w+1)], *sumsq1 = &task->sumsq[y1*(w+1)];
+
+        for (int x = 0; x < w; x++) {
+            int x0 = imax(0, x - r), x1 = imin(w, x + r + 1);
+            uint64_t n = (y1 - y0) * (x1 - x0);
 
-        struct blur_task *blur_tasks = malloc(sizeof(struct blur_task)*th);
-        for (int ty = 0; ty < th; ty++) {
-            blur_tasks[ty].im = im;
-            blur_tasks[ty].im_max = im_max;
-            blur_tasks[ty].im_min = im_min;
-            blur_tasks[ty].im_max_tmp = im_max_tmp;
-            blur_tasks[ty].im_min_tmp = im_min_tmp;
-            blur_tasks[ty].ty = ty;
+            uint32_t sum = sum1[x1] - sum1[x0] - sum0[x1] + sum0[x0];
+            uint32_t sumsq = sumsq1[x1] - sumsq1[x0] - sumsq0[x1] + sumsq0[x0];
 
-            workerpool_add_task(td->wp, do_blur_task, &blur_tasks[ty]);
+            // n^2 times the variance of the window.
+            uint64_t var = n*sumsq - (uint64_t) sum*sum;
+
+            uint8_t v = im->buf[y*s+x];
+            if (4*var < diff*diff*n*n)
+                out[x] = 127;
+            else if (v*n > sum)
+                out[x] = 255;
+            else
+                out[x] = 0;
         }
-        workerpool_run(td->wp);
-        free(blur_tasks);
-        free(im_max);
-        free(im_min);
-        im_max = im_max_tmp;
-        im_min = im_min_tmp;
+
+        thresh_image_pack_row(task->threshim, y, out);
     }
+}
 
-    struct threshold_task *threshold_tasks = malloc(sizeof(struct threshold_task)*th);
-    for (int ty = 0; ty < th; ty++) {
-        threshold_tasks[ty].im = im;
-        threshold_tasks[ty].threshim = threshim;
-        threshold_tasks[ty].im_max = im_max;
-        threshold_tasks[ty].im_min = im_min;
-        threshold_tasks[ty].ty = ty;
-        threshold_tasks[ty].td = td;
+// rowsz bytes of rows are given to each task, as task->row. Returns
+// non-zero if those cannot be allocated.
+static int run_local_mean_pass(apriltag_detector_t *td, enum apriltag_stage stage, struct local_mean_task *proto,
+                                int sz, void (*f)(void *p), struct local_mean_task *tasks, int rowsz)
+{
+    int64_t utime0 = utime_now();
+    int chunksize = apriltag_task_chunksize(td, stage, sz);
+    int ntasks = 0;
+
+    uint8_t *rows = NULL;
+    if (rowsz > 0)
+        rows = ws_reserve(&td->ws->local_mean_rows, (size_t) rowsz*((sz + chunksize - 1) / chunksize));
+    if (rowsz > 0 && !rows)
+        return -1;
+
+    for (int i = 0; i < sz; i += chunksize) {
+        tasks[ntasks] = *proto;
+        tasks[ntasks].i0 = i;
+        tasks[ntasks].i1 = imin(sz, i + chunksize);
+        tasks[ntasks].row = rows ? &rows[(size_t) rowsz*ntasks] : NULL;
 
-        workerpool_add_task(td->wp, do_threshold_task, &threshold_tasks[ty]);
+        workerpool_add_task(td->wp, f, &tasks[ntasks]);
+        ntasks++;
     }
     workerpool_run(td->wp);
-    free(threshold_tasks);
 
-    // we skipped over the non-full-sized tiles above. Fix those now.
-    if (1) {
-        for (int y = 0; y < h; y++) {
+    apriltag_task_timing(td, stage, sz, ntasks, utime0);
+    return 0;
+}
 
-            // what is the first x coordinate we need to process in this row?
+// An alternative to the tile statistics: threshold every pixel
+// against the mean of a window spanning (about) the same 3x3 tiles,
+// computed from summed-area tables so that the cost per pixel does
+// not depend on the window size. Returns non-zero if the tables
+// cannot be allocated.
+static int threshold_local_mean(apriltag_detector_t *td, image_u8_t *im, struct thresh_image *threshim, int tilesz)
+{
+    int w = im->width, h = im->height;
 
-            int x0;
+    struct local_mean_task proto;
+    proto.td = td;
+    proto.im = im;
+    proto.threshim = threshim;
+    // keep the windows at most 255 pixels wide; see do_local_mean_task.
+    proto.r = imin(127, 3*tilesz/2);
+    proto.sum = ws_reserve(&td->ws->sum, sizeof(uint32_t)*(w+1)*(h+1));
+    proto.sumsq = ws_reserve(&td->ws->sumsq, sizeof(uint32_t)*(w+1)*(h+1));
+    struct local_mean_task *tasks = ws_reserve(&td->ws->local_mean_tasks, sizeof(struct local_mean_task)*(imax(w, h) + 1));
+    if (!proto.sum || !proto.sumsq || !tasks)
+        return -1;
 
-            if (y >= th*tilesz) {
-                x0 = 0; // we're at the bottom; do the whole row.
-            } else {
-                x0 = tw*tilesz; // we only need to do the right most part.
-            }
+    memset(proto.sum, 0, sizeof(uint32_t)*(w+1));
+    memset(proto.sumsq, 0, sizeof(uint32_t)*(w+1));
 
-            // compute tile coordinates and clamp.
-            int ty = y / tilesz;
-            if (ty >= th)
-                ty = th - 1;
+    run_local_mean_pass(td, APRILTAG_STAGE_LOCAL_MEAN_SUMS, &proto, h, do_integral_rows_task, tasks, 0);
 
-            for (int x = x0; x < w; x++) {
-                int tx = x / tilesz;
-                if (tx >= tw)
-                    tx = tw - 1;
+    run_local_mean_pass(td, APRILTAG_STAGE_LOCAL_MEAN_SUMS, &proto, w, do_integral_cols_task, tasks, 0);
 
-                int max = im_max[ty*tw + tx];
-                int min = im_min[ty*tw + tx];
-                int thresh = min + (max - min) / 2;
+    return run_local_mean_pass(td, APRILTAG_STAGE_LOCAL_MEAN, &proto, h, do_local_mean_task, tasks, w);
+}
 
-                uint8_t v = im->buf[y*s+x];
-                if (v > thresh)
-                    threshim->buf[y*s+x] = 255;
-                else
-                    threshim->buf[y*s+x] = 0;
-            }
-        }
-    }
+// returns NULL if the thresholded image cannot be allocated.
+struct thresh_image *threshold(apriltag_detector_t *td, image_u8_t *im)
+{
+    int w = im->width, h = im->height, s = im->stride;
+    assert(w < 32768);
+    assert(h < 32768);
+
+    struct thresh_image *threshim = thresh_image_reset(apriltag_workspace_get(td), w, h);
+    if (!threshim)
+        return NULL;
+
+    // The idea is to find the maximum and minimum values in a
+    // window around each pixel. If it's a contrast-free region
+    // (max-min is small), don't try to binarize. Otherwise,
+    // threshold according to (max+min)/2.
+    //
+    // Mark low-contrast regions with value 127 (i.e., not valid in
+    // the packed image) so that we can skip future work on these
+    // areas too.
+
+    // however, computing max/min around every pixel is needlessly
+    // expensive. We compute max/min for tiles. To avoid artifacts
+    // that arise when high-contrast features appear near a tile
+    // edge (and thus moving from one tile to another results in a
+    // large change in max/min value), the max/min values used for
+    // any pixel are computed from all 3x3 surrounding tiles. Thus,
+    // the max/min sampling area for nearby pixels overlap by at least
+    // one tile.
+    //
+    // The important thing is that the windows be large enough to
+    // capture edge transitions; the tag does not need to fit into
+    // a tile.
 
-    free(im_min);
-    free(im_max);
+    // XXX Tunable. Generally, small tile sizes--- so long as they're
+    // large enough to span a single tag edge--- seem to be a winner.
+    int tilesz = imax(1, td->qtp.threshold_tile_size);
+
+    int err;
+    if (td->qtp.threshold_local_mean)
+        err = threshold_local_mean(td, im, threshim, tilesz);
+    else
+        err = threshold_tiles(td, im, threshim, tilesz);
+    if (err)
+        return NULL;
 
     // this is a dilate/erode deglitching scheme that does not improve
-    // anything as far as I can tell.
+    // anything as far as I can tell. It works on the unpacked image.
     if (td->qtp.deglitch) {
+        image_u8_t *im8 = image_u8_create_alignment(w, h, s);
+        for (int y = 0; y < h; y++)
+            thresh_image_unpack_row(threshim, y, &im8->buf[y*s]);
+
         image_u8_t *tmp = image_u8_create(w, h);
 
         for (int y = 1; y + 1 < h; y++) {
@@ -1360,7 +2471,7 @@ image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
                 uint8_t max = 0;
                 for (int dy = -1; dy <= 1; dy++) {
                     for (int dx = -1; dx <= 1; dx++) {
-                        uint8_t v = threshim->buf[(y+dy)*s + x + dx];
+                        uint8_t v = im8->buf[(y+dy)*s + x + dx];
                         if (v > max)
                             max = v;
                     }
@@ -1379,11 +2490,15 @@ image_u8_t *threshold(apriltag_detector_t *td, image_u8_t *im)
                             min = v;
                     }
                 }
-                threshim->buf[y*s+x] = min;
+                im8->buf[y*s+x] = min;
             }
         }
 
         image_u8_destroy(tmp);
+
+        for (int y = 0; y < h; y++)
+            thresh_image_pack_row(threshim, y, &im8->buf[y*s]);
+        image_u8_destroy(im8);
     }
 
     timeprofile_stamp(td->tp, "threshold");
@@ -1510,34 +2625,82 @@ image_u8_t *threshold_bayer(apriltag_detector_t *td, image_u8_t *im)
     return threshim;
 }
 
-unionfind_t* connected_components(apriltag_detector_t *td, image_u8_t* threshim, int w, int h, int ts) {
-    unionfind_t *uf = unionfind_create(w * h);
+// The connected components are found over the runs of each row
+// rather than over individual pixels, which needs far fewer nodes
+// (and unions). The sizes of the sets are still counted in pixels.
+// Returns NULL if the runs cannot be allocated.
+unionfind_t* connected_components(apriltag_detector_t *td, struct thresh_image* threshim, int w, int h) {
+    struct apriltag_workspace *ws = td->ws;
+    threshim->row_runs = ws_reserve(&ws->row_runs, sizeof(uint32_t)*(h + 1));
+
+    int64_t utime0 = utime_now();
+    int bandsz = apriltag_task_chunksize(td, APRILTAG_STAGE_RUNS, h);
+    struct unionfind_task *bands = ws_reserve(&ws->bands, sizeof(struct unionfind_task)*(h / bandsz + 1));
+    if (!threshim->row_runs || !bands)
+        return NULL;
+
+    threshim->row_runs[0] = 0;
+    int nbands = 0;
+    for (int i = 0; i < h; i += bandsz) {
+        bands[nbands].y0 = i;
+        bands[nbands].y1 = imin(h, i + bandsz);
+        bands[nbands].h = h;
+        bands[nbands].w = w;
+        bands[nbands].im = threshim;
+        nbands++;
+    }
+
+    for (int i = 0; i < nbands; i++)
+        workerpool_add_task(td->wp, do_count_runs_task, &bands[i]);
+    workerpool_run(td->wp);
+
+    for (int y = 0; y < h; y++)
+        threshim->row_runs[y + 1] += threshim->row_runs[y];
+
+    uint32_t nruns = threshim->row_runs[h];
+    threshim->runs = ws_reserve(&ws->runs, sizeof(struct thresh_run)*nruns);
+    if (!threshim->runs)
+        return NULL;
+    unionfind_t *uf = ws->uf;
+    if (unionfind_reset(uf, nruns) != 0) {
+        debug_print("Memory allocation failed\n");
+        return NULL;
+    }
+
+    for (int i = 0; i < nbands; i++) {
+        bands[i].uf = uf;
+        workerpool_add_task(td->wp, do_fill_runs_task, &bands[i]);
+    }
+    workerpool_run(td->wp);
+
+    apriltag_task_timing(td, APRILTAG_STAGE_RUNS, h, nbands, utime0);
 
     if (td->nthreads <= 1) {
-        do_unionfind_first_line(uf, threshim, w, ts);
         for (int y = 1; y < h; y++) {
-            do_unionfind_line2(uf, threshim, w, ts, y);
+            do_unionfind_line2(uf, threshim, w, y, NULL);
         }
     } else {
-        do_unionfind_first_line(uf, threshim, w, ts);
-
         int sz = h;
-        int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
-        struct unionfind_task *tasks = malloc(sizeof(struct unionfind_task)*(sz / chunksize + 1));
+        utime0 = utime_now();
+        int chunksize = apriltag_task_chunksize(td, APRILTAG_STAGE_UNIONFIND, sz);
+        struct unionfind_task *tasks = ws_reserve(&ws->unionfind_tasks, sizeof(struct unionfind_task)*(sz / chunksize + 1));
+        if (!tasks)
+            return NULL;
 
         int ntasks = 0;
 
         for (int i = 1; i < sz; i += chunksize) {
             // each task will process [y0, y1). Note that this attaches
-            // each cell to the right and down, so row y1 *is* potentially modified.
+            // each run to the ones above, so row y0-1 *is* potentially modified.
             //
             // for parallelization, make sure that each task doesn't touch rows
             // used by another thread.
+            // the row between two tasks is stitched afterwards, but
+            // there is none after the last one, which must take it.
             tasks[ntasks].y0 = i;
-            tasks[ntasks].y1 = imin(sz, i + chunksize - 1);
+            tasks[ntasks].y1 = i + chunksize >= sz ? sz : i + chunksize - 1;
             tasks[ntasks].h = h;
             tasks[ntasks].w = w;
-            tasks[ntasks].s = ts;
             tasks[ntasks].uf = uf;
             tasks[ntasks].im = threshim;
 
@@ -1547,214 +2710,540 @@ unionfind_t* connected_components(apriltag_detector_t *td, image_u8_t* threshim,
 
         workerpool_run(td->wp);
 
-        // XXX stitch together the different chunks.
-        for (int i = 1; i < ntasks; i++) {
-            do_unionfind_line2(uf, threshim, w, ts, tasks[i].y0 - 1);
+        // stitch together the different chunks, in parallel. The set
+        // sizes stay those of the chunks until every stitch is done,
+        // then the sizes of the linked trees are added to their roots.
+        // (Serially, without the atomics the concurrent unions need.)
+        if (!UNIONFIND_HAVE_CONCURRENT) {
+            for (int i = 1; i < ntasks; i++)
+                do_unionfind_line2(uf, threshim, w, tasks[i].y0 - 1, NULL);
+        } else {
+            if (ws->nlinked < ntasks) {
+                zarray_t **linked = realloc(ws->linked, sizeof(zarray_t*)*ntasks);
+                if (!linked) {
+                    debug_print("Memory allocation failed\n");
+                    return NULL;
+                }
+                ws->linked = linked;
+                for (; ws->nlinked < ntasks; ws->nlinked++)
+                    ws->linked[ws->nlinked] = zarray_create(sizeof(uint32_t));
+            }
+
+            for (int i = 1; i < ntasks; i++) {
+                tasks[i].linked = ws->linked[i];
+                zarray_clear(tasks[i].linked);
+                workerpool_add_task(td->wp, do_stitch_task, &tasks[i]);
+            }
+
+            workerpool_run(td->wp);
+
+            for (int i = 1; i < ntasks; i++) {
+                for (int j = 0; j < zarray_size(tasks[i].linked); j++) {
+                    uint32_t root;
+                    zarray_get(tasks[i].linked, j, &root);
+                    unionfind_add_linked_size(uf, root);
+                }
+            }
         }
 
-        free(tasks);
+        apriltag_task_timing(td, APRILTAG_STAGE_UNIONFIND, sz, ntasks, utime0);
     }
     return uf;
 }
 
-zarray_t* do_gradient_clusters(image_u8_t* threshim, int ts, int y0, int y1, int w, int nclustermap, unionfind_t* uf, zarray_t* clusters) {
-    struct uint64_zarray_entry **clustermap = calloc(nclustermap, sizeof(struct uint64_zarray_entry*));
+// the run containing valid pixel x, starting from the run at *cursor
+// (which must be in the same row).
+static inline uint32_t run_at(const struct thresh_run *runs, uint32_t *cursor, int x)
+{
+    uint32_t c = *cursor;
+    while (runs[c].x1 < x)
+        c++;
+    while (runs[c].x0 > x)
+        c--;
+    *cursor = c;
+    return c;
+}
+
+static int cluster_info_compare(const void *_a, const void *_b)
+{
+    const struct cluster_info *a = _a, *b = _b;
+    return (a->id > b->id) - (a->id < b->id);
+}
 
-    int mem_chunk_size = 2048;
-    struct uint64_zarray_entry** mem_pools = malloc(sizeof(struct uint64_zarray_entry *)*(1 + 2 * nclustermap / mem_chunk_size)); // SmodeTech: avoid memory corruption when nclustermap < mem_chunk_size
-    int mem_pool_idx = 0;
-    int mem_pool_loc = 0;
-    mem_pools[mem_pool_idx] = calloc(mem_chunk_size, sizeof(struct uint64_zarray_entry));
+// Readies map for a new frame. Returns non-zero if its table cannot
+// be allocated.
+static int cluster_map_reset(struct cluster_map *map)
+{
+    if (map->slots == NULL) {
+        map->nslots = 1024;
+        map->slots = calloc(map->nslots, sizeof(struct cluster_slot));
+        if (map->slots == NULL) {
+            debug_print("Memory allocation failed\n");
+            return -1;
+        }
+        map->info = zarray_create(sizeof(struct cluster_info));
+    }
+    zarray_clear(map->info);
+    map->npts = 0;
+    map->nrefs = 0;
+    map->failed = false;
+    return 0;
+}
 
-    for (int y = y0; y < y1; y++) {
-        bool connected_last = false;
-        for (int x = 1; x < w-1; x++) {
+// Doubles the table. If that fails, sets map->failed and keeps the
+// table as it is.
+static void cluster_map_grow(struct cluster_map *map)
+{
+    struct cluster_slot *slots = calloc(2*map->nslots, sizeof(struct cluster_slot));
+    if (slots == NULL) {
+        debug_print("Memory allocation failed\n");
+        map->failed = true;
+        return;
+    }
+    free(map->slots);
+    map->nslots *= 2;
+    map->slots = slots;
+
+    uint32_t mask = map->nslots - 1;
+    for (int i = 0; i < zarray_size(map->info); i++) {
+        struct cluster_info *info;
+        zarray_get_volatile(map->info, i, &info);
+
+        uint32_t slot = u64hash_mix(info->id) & mask;
+        while (map->slots[slot].id != 0)
+            slot = (slot + 1) & mask;
+
+        map->slots[slot].id = info->id;
+        map->slots[slot].cluster = i;
+        info->slot = slot;
+    }
+}
 
-            uint8_t v0 = threshim->buf[y*ts + x];
-            if (v0 == 127) {
-                connected_last = false;
-                continue;
-            }
+// Returns the index of the cluster with the given id, adding it if it
+// is new.
+static inline uint32_t cluster_map_find(struct cluster_map *map, uint64_t id)
+{
+    uint32_t mask = map->nslots - 1;
+    uint32_t slot = u64hash_mix(id) & mask;
+
+    while (map->slots[slot].id != id) {
+        if (map->slots[slot].id == 0) {
+            // the table is not grown any more: the frame's clusters are
+            // dropped anyway (see cluster_map_finish).
+            if (map->failed)
+                return 0;
+
+            uint32_t cluster = zarray_size(map->info);
+            struct cluster_info info = { .id = id, .slot = slot, .index = cluster, .npts = 0 };
+            zarray_add(map->info, &info);
+            map->slots[slot].id = id;
+            map->slots[slot].cluster = cluster;
+
+            if (2*(cluster + 1) > map->nslots)
+                cluster_map_grow(map);
+            return cluster;
+        }
+        slot = (slot + 1) & mask;
+    }
 
-            // XXX don't query this until we know we need it?
-            uint64_t rep0 = unionfind_get_representative(uf, y*w + x);
-            if (unionfind_get_set_size(uf, rep0) < 25) {
-                connected_last = false;
-                continue;
-            }
+    return map->slots[slot].cluster;
+}
 
-            // whenever we find two adjacent pixels such that one is
-            // white and the other black, we add the point half-way
-            // between them to a cluster associated with the unique
-            // ids of the white and black regions.
-            //
-            // We additionally compute the gradient direction (i.e., which
-            // direction was the white pixel?) Note: if (v1-v0) == 255, then
-            // (dx,dy) points towards the white pixel. if (v1-v0) == -255, then
-            // (dx,dy) points towards the black pixel. p.gx and p.gy will thus
-            // be -255, 0, or 255.
-            //
-            // Note that any given pixel might be added to multiple
-            // different clusters. But in the common case, a given
-            // pixel will be added multiple times to the same cluster,
-            // which increases the size of the cluster and thus the
-            // computational costs.
-            //
-            // A possible optimization would be to combine entries
-            // within the same cluster.
+// Grows the points of map. If that fails, sets map->failed.
+static bool cluster_map_grow_pts(struct cluster_map *map)
+{
+    int capacity = imax(1024, 2*map->pts_capacity);
+    struct cluster_pt *pts = realloc(map->pts, sizeof(struct cluster_pt)*capacity);
+    if (pts == NULL) {
+        debug_print("Memory allocation failed\n");
+        map->failed = true;
+        return false;
+    }
+    map->pts = pts;
+    map->pts_capacity = capacity;
+    return true;
+}
 
-            bool connected;
-#define DO_CONN(dx, dy)                                                 \
-            if (1) {                                                    \
-                uint8_t v1 = threshim->buf[(y + dy)*ts + x + dx];       \
-                                                                        \
-                if (v0 + v1 == 255) {                                   \
-                    uint64_t rep1 = unionfind_get_representative(uf, (y + dy)*w + x + dx); \
-                    if (unionfind_get_set_size(uf, rep1) > 24) {        \
-                        uint64_t clusterid;                                 \
-                        if (rep0 < rep1)                                    \
-                            clusterid = (rep1 << 32) + rep0;                \
-                        else                                                \
-                            clusterid = (rep0 << 32) + rep1;                \
-                                                                            \
-                        /* XXX lousy hash function */                       \
-                        uint32_t clustermap_bucket = u64hash_2(clusterid) % nclustermap; \
-                        struct uint64_zarray_entry *entry = clustermap[clustermap_bucket]; \
-                        while (entry && entry->id != clusterid) {           \
-                            entry = entry->next;                            \
-                        }                                                   \
-                                                                            \
-                        if (!entry) {                                       \
-                            if (mem_pool_loc == mem_chunk_size) {           \
-                                mem_pool_loc = 0;                           \
-                                mem_pool_idx++;                             \
-                                mem_pools[mem_pool_idx] = calloc(mem_chunk_size, sizeof(struct uint64_zarray_entry)); \
-                            }                                               \
-                            entry = mem_pools[mem_pool_idx] + mem_pool_loc; \
-                            mem_pool_loc++;                                 \
-                                                                            \
-                            entry->id = clusterid;                          \
-                            entry->cluster = zarray_create(sizeof(struct pt)); \
-                            entry->next = clustermap[clustermap_bucket];    \
-                            clustermap[clustermap_bucket] = entry;          \
-                        }                                                   \
-                                                                            \
-                        struct pt p = { .x = 2*x + dx, .y = 2*y + dy, .gx = dx*((int) v1-v0), .gy = dy*((int) v1-v0)}; \
-                        zarray_add(entry->cluster, &p);                     \
-                        connected = true;                                   \
-                    }                                                   \
-                }                                                       \
-            }
+static inline void cluster_map_add(struct cluster_map *map, const struct cluster_pt *cp)
+{
+    if (map->npts == map->pts_capacity && !cluster_map_grow_pts(map))
+        return;
+    map->pts[map->npts++] = *cp;
+    ((struct cluster_info*) map->info->data)[cp->cluster].npts++;
+}
 
-            // do 4 connectivity. NB: Arguments must be [-1, 1] or we'll overflow .gx, .gy
-            DO_CONN(1, 0);
-            DO_CONN(0, 1);
-
-            // do 8 connectivity
-            if (!connected_last) {
-                // Checking 1, 1 on the previous x, y, and -1, 1 on the current
-                // x, y result in duplicate points in the final list.  Only
-                // check the potential duplicate if adding this one won't
-                // create a duplicate.
-                DO_CONN(-1, 1);
-            }
-            connected = false;
-            DO_CONN(1, 1);
-            connected_last = connected;
+// The points added by one pixel, while aggregating them. A pixel adds
+// at most four points, one per direction.
+struct pixel_points
+{
+    int start; // index of its first point in map->pts
+    int sum_x[4], sum_y[4], n[4];
+};
+
+// Adds a point, or merges it into the point the pixel already added to
+// the same cluster, summing their gradients.
+static inline void cluster_map_aggregate(struct cluster_map *map, struct pixel_points *pixel,
+                                         const struct cluster_pt *cp)
+{
+    for (int k = pixel->start; k < map->npts; k++) {
+        if (map->pts[k].cluster == cp->cluster) {
+            int j = k - pixel->start;
+            pixel->sum_x[j] += cp->p.x;
+            pixel->sum_y[j] += cp->p.y;
+            pixel->n[j]++;
+            map->pts[k].p.gx += cp->p.gx;
+            map->pts[k].p.gy += cp->p.gy;
+            return;
         }
     }
-#undef DO_CONN
 
-    for (int i = 0; i < nclustermap; i++) {
-        int start = zarray_size(clusters);
-        for (struct uint64_zarray_entry *entry = clustermap[i]; entry; entry = entry->next) {
-            struct cluster_hash* cluster_hash = malloc(sizeof(struct cluster_hash));
-            cluster_hash->hash = u64hash_2(entry->id) % nclustermap;
-            cluster_hash->id = entry->id;
-            cluster_hash->data = entry->cluster;
-            zarray_add(clusters, &cluster_hash);
-        }
-        int end = zarray_size(clusters);
-
-        // Do a quick bubblesort on the secondary key.
-        int n = end - start;
-        for (int j = 0; j < n - 1; j++) {
-            for (int k = 0; k < n - j - 1; k++) {
-                struct cluster_hash** hash1;
-                struct cluster_hash** hash2;
-                zarray_get_volatile(clusters, start + k, &hash1);
-                zarray_get_volatile(clusters, start + k + 1, &hash2);
-                if ((*hash1)->id > (*hash2)->id) {
-                    struct cluster_hash tmp = **hash2;
-                    **hash2 = **hash1;
-                    **hash1 = tmp;
+    int j = map->npts - pixel->start;
+    pixel->sum_x[j] = cp->p.x;
+    pixel->sum_y[j] = cp->p.y;
+    pixel->n[j] = 1;
+    cluster_map_add(map, cp);
+}
+
+// Moves each merged point of a pixel to the mean of the points it
+// stands for (rounded to the half-pixel grid), and records how many
+// those are.
+static inline void cluster_map_aggregate_finish(struct cluster_map *map, const struct pixel_points *pixel)
+{
+    for (int k = pixel->start; k < map->npts; k++) {
+        int j = k - pixel->start;
+        if (pixel->n[j] > 1) {
+            map->pts[k].p.x = (2*pixel->sum_x[j] + pixel->n[j]) / (2*pixel->n[j]);
+            map->pts[k].p.y = (2*pixel->sum_y[j] + pixel->n[j]) / (2*pixel->n[j]);
+            map->pts[k].p.n = pixel->n[j];
+        }
+    }
+}
+
+// Empties the table, and groups the points of each cluster together
+// (in the order they were found), listing the clusters by id in refs.
+// Sets map->failed if those cannot be allocated, and lists no clusters
+// if it is set.
+static void cluster_map_finish(struct cluster_map *map)
+{
+    int ninfo = zarray_size(map->info);
+    int npts = map->npts;
+    struct cluster_info *info = (struct cluster_info*) map->info->data;
+    const struct cluster_pt *pts = map->pts;
+
+    for (int i = 0; i < ninfo; i++)
+        map->slots[info[i].slot].id = 0;
+
+    // after sorting, info[i].index is still the cluster index used by
+    // the points.
+    if (ninfo > 1)
+        qsort(info, ninfo, sizeof(struct cluster_info), cluster_info_compare);
+
+    struct pt *grouped = ws_reserve(&map->grouped, sizeof(struct pt)*npts);
+    uint32_t *offsets = ws_reserve(&map->offsets, sizeof(uint32_t)*ninfo);
+    struct cluster_ref *refs = ws_reserve(&map->refs, sizeof(struct cluster_ref)*ninfo);
+    map->failed = map->failed || !grouped || !offsets || !refs;
+    if (map->failed) {
+        map->nrefs = 0;
+        return;
+    }
+
+    uint32_t offset = 0;
+    for (int i = 0; i < ninfo; i++) {
+        offsets[info[i].index] = offset;
+        refs[i].id = info[i].id;
+        refs[i].pts = &grouped[offset];
+        refs[i].npts = info[i].npts;
+        offset += info[i].npts;
+    }
+    map->nrefs = ninfo;
+
+    for (int i = 0; i < npts; i++)
+        grouped[offsets[pts[i].cluster]++] = pts[i].p;
+}
+
+void do_gradient_clusters(struct thresh_image* threshim, int y0, int y1, int w, bool aggregate, struct cluster_map *map, unionfind_t* uf) {
+    // consecutive points mostly belong to the same cluster.
+    uint64_t last_id = 0;
+    uint32_t last_cluster = 0;
+
+    int stride = threshim->stride;
+    const struct thresh_run *runs = threshim->runs;
+
+    for (int y = y0; y < y1 && !map->failed; y++) {
+        const uint64_t *v0 = &threshim->valid[y*stride], *p0 = &threshim->polarity[y*stride];
+        const uint64_t *v1 = v0 + stride, *p1 = p0 + stride; // the row below
+
+        // the runs of this row and the next one containing the
+        // pixels last looked up.
+        uint32_t cursor[2] = { threshim->row_runs[y], threshim->row_runs[y + 1] };
+
+        bool connected_last = false;
+        int last_x = -1;
+
+        for (int i = 0; i < (w + 63) / 64; i++) {
+            uint64_t ref = v0[i] & reference_mask(w, i);
+            if (!ref)
+                continue;
+
+            // pixels with a valid neighbor of the opposite color at
+            // (dx,dy), i.e. v0 + v1 == 255 in the unpacked image.
+            uint64_t edge_1_0 = ref & bits_right(v0, i) & (p0[i] ^ bits_right(p0, i));
+            uint64_t edge_0_1 = ref & v1[i] & (p0[i] ^ p1[i]);
+            uint64_t edge_m1_1 = ref & bits_left(v1, i) & (p0[i] ^ bits_left(p1, i));
+            uint64_t edge_1_1 = ref & bits_right(v1, i) & (p0[i] ^ bits_right(p1, i));
+
+            uint64_t todo = edge_1_0 | edge_0_1 | edge_m1_1 | edge_1_1;
+            while (todo) {
+                int b = simd_ctz64(todo);
+                todo &= todo - 1;
+                int x = 64*i + b;
+
+                // a pixel without any edges never connects at (1,1).
+                if (x != last_x + 1)
+                    connected_last = false;
+                last_x = x;
+
+                uint64_t rep0 = unionfind_get_representative(uf, run_at(runs, &cursor[0], x));
+                if (unionfind_get_set_size(uf, rep0) < 25) {
+                    connected_last = false;
+                    continue;
                 }
+
+                // whenever we find two adjacent pixels such that one is
+                // white and the other black, we add the point half-way
+                // between them to a cluster associated with the unique
+                // ids of the white and black regions.
+                //
+                // We additionally compute the gradient direction (i.e., which
+                // direction was the white pixel?) Note: if dv == 255, then
+                // (dx,dy) points towards the white pixel. if dv == -255, then
+                // (dx,dy) points towards the black pixel. p.gx and p.gy will thus
+                // be -255, 0, or 255.
+                //
+                // Note that any given pixel might be added to multiple
+                // different clusters. But in the common case, a given
+                // pixel will be added multiple times to the same cluster,
+                // which increases the size of the cluster and thus the
+                // computational costs.
+                //
+                // With aggregate set, the points a pixel adds to the
+                // same cluster are combined into one.
+
+                // v1 - v0
+                int dv = (p0[i] >> b) & 1 ? -255 : 255;
+
+                struct pixel_points pixel = { .start = map->npts };
+
+                bool connected;
+#define DO_CONN(dx, dy, edges)                                          \
+                if ((edges >> b) & 1) {                                 \
+                    uint64_t rep1 = unionfind_get_representative(uf, run_at(runs, &cursor[dy], x + dx)); \
+                    if (unionfind_get_set_size(uf, rep1) > 24) {        \
+                        uint64_t clusterid;                             \
+                        if (rep0 < rep1)                                \
+                            clusterid = (rep1 << 32) + rep0;            \
+                        else                                            \
+                            clusterid = (rep0 << 32) + rep1;            \
+                                                                        \
+                        if (clusterid != last_id) {                     \
+                            last_cluster = cluster_map_find(map, clusterid); \
+                            last_id = clusterid;                        \
+                        }                                               \
+                        struct cluster_pt cp = {                        \
+                            .p = { .x = 2*x + dx, .y = 2*y + dy, .gx = dx*dv, .gy = dy*dv, .n = 1 }, \
+                            .cluster = last_cluster };                  \
+                        if (aggregate)                                  \
+                            cluster_map_aggregate(map, &pixel, &cp);    \
+                        else                                            \
+                            cluster_map_add(map, &cp);                  \
+                        connected = true;                               \
+                    }                                                   \
+                }
+
+                // do 4 connectivity. NB: Arguments must be [-1, 1] or we'll overflow .gx, .gy
+                DO_CONN(1, 0, edge_1_0);
+                DO_CONN(0, 1, edge_0_1);
+
+                // do 8 connectivity
+                if (!connected_last) {
+                    // Checking 1, 1 on the previous x, y, and -1, 1 on the current
+                    // x, y result in duplicate points in the final list.  Only
+                    // check the potential duplicate if adding this one won't
+                    // create a duplicate.
+                    DO_CONN(-1, 1, edge_m1_1);
+                }
+                connected = false;
+                DO_CONN(1, 1, edge_1_1);
+                connected_last = connected;
+
+                if (aggregate)
+                    cluster_map_aggregate_finish(map, &pixel);
             }
         }
     }
-    for (int i = 0; i <= mem_pool_idx; i++) {
-        free(mem_pools[i]);
-    }
-    free(mem_pools);
-    free(clustermap);
+#undef DO_CONN
 
-    return clusters;
+    cluster_map_finish(map);
 }
 
 static void do_cluster_task(void *p)
 {
     struct cluster_task *task = (struct cluster_task*) p;
 
-    do_gradient_clusters(task->im, task->s, task->y0, task->y1, task->w, task->nclustermap, task->uf, task->clusters);
-}
-
-zarray_t* merge_clusters(zarray_t* c1, zarray_t* c2) {
-    zarray_t* ret = zarray_create(sizeof(struct cluster_hash*));
-    zarray_ensure_capacity(ret, zarray_size(c1) + zarray_size(c2));
-
-    int i1 = 0;
-    int i2 = 0;
-    int l1 = zarray_size(c1);
-    int l2 = zarray_size(c2);
-
-    while (i1 < l1 && i2 < l2) {
-        struct cluster_hash** h1;
-        struct cluster_hash** h2;
-        zarray_get_volatile(c1, i1, &h1);
-        zarray_get_volatile(c2, i2, &h2);
-
-        if ((*h1)->hash == (*h2)->hash && (*h1)->id == (*h2)->id) {
-            zarray_add_range((*h1)->data, (*h2)->data, 0, zarray_size((*h2)->data));
-            zarray_add(ret, h1);
-            i1++;
-            i2++;
-            zarray_destroy((*h2)->data);
-            free(*h2);
-        } else if ((*h2)->hash < (*h1)->hash || ((*h2)->hash == (*h1)->hash && (*h2)->id < (*h1)->id)) {
-            zarray_add(ret, h2);
-            i2++;
-        } else {
-            zarray_add(ret, h1);
-            i1++;
-        }
+    do_gradient_clusters(task->im, task->y0, task->y1, task->w, task->aggregate, task->map, task->uf);
+}
+
+// Merges the lists a and b, both sorted by id, into out. Equal ids are
+// kept, those from a first.
+static void merge_cluster_refs(const struct cluster_ref *a, int na, const struct cluster_ref *b, int nb,
+                               struct cluster_ref *out)
+{
+    int ia = 0, ib = 0;
+    while (ia < na && ib < nb) {
+        if (b[ib].id < a[ia].id)
+            *out++ = b[ib++];
+        else
+            *out++ = a[ia++];
     }
+    memcpy(out, &a[ia], sizeof(struct cluster_ref)*(na - ia));
+    out += na - ia;
+    memcpy(out, &b[ib], sizeof(struct cluster_ref)*(nb - ib));
+}
 
-    zarray_add_range(ret, c1, i1, l1);
-    zarray_add_range(ret, c2, i2, l2);
+static int u64_compare(const void *_a, const void *_b)
+{
+    uint64_t a = *(const uint64_t*) _a, b = *(const uint64_t*) _b;
+    return (a > b) - (a < b);
+}
 
-    zarray_destroy(c1);
-    zarray_destroy(c2);
+// the index of the first ref of list with an id of at least id.
+static int cluster_refs_lower_bound(const struct cluster_ref *list, int n, uint64_t id)
+{
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (list[mid].id < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Merges the part of each task's cluster list in [starts[i], ends[i])
+// pairwise, so that the parts of each cluster end up next to each
+// other, in task order. Then counts the clusters, and the points of
+// those that were split between tasks.
+static void do_cluster_merge_task(void *p)
+{
+    struct cluster_merge_task *task = (struct cluster_merge_task*) p;
+    struct cluster_ref *refs = task->refs, *tmp = task->tmp;
+
+    int *bounds = task->bounds;
+    int nmaps = task->nmaps;
+
+    int n = 0;
+    for (int i = 0; i < nmaps; i++) {
+        const struct cluster_ref *list = task->maps[i].refs.data;
+        int len = task->ends[i] - task->starts[i];
+        memcpy(&refs[n], &list[task->starts[i]], sizeof(struct cluster_ref)*len);
+        bounds[i] = n;
+        n += len;
+    }
+    bounds[nmaps] = n;
+
+    int length = nmaps;
+    while (length > 1) {
+        int write = 0;
+        for (int i = 0; i < length; i += 2) {
+            int end = i + 1 < length ? bounds[i + 2] : bounds[i + 1];
+            if (i + 1 < length)
+                merge_cluster_refs(&refs[bounds[i]], bounds[i + 1] - bounds[i],
+                                   &refs[bounds[i + 1]], end - bounds[i + 1], &tmp[bounds[i]]);
+            else
+                memcpy(&tmp[bounds[i]], &refs[bounds[i]], sizeof(struct cluster_ref)*(end - bounds[i]));
+            bounds[write + 1] = end;
+            write++;
+        }
 
-    return ret;
+        struct cluster_ref *t = refs;
+        refs = tmp;
+        tmp = t;
+        length = write;
+    }
+    task->merged = refs;
+
+    task->nclusters = 0;
+    task->nsplit = 0;
+    for (int i = 0; i < n; ) {
+        int j = i + 1, npts = refs[i].npts;
+        while (j < n && refs[j].id == refs[i].id)
+            npts += refs[j++].npts;
+        if (j > i + 1)
+            task->nsplit += npts;
+        task->nclusters++;
+        i = j;
+    }
 }
 
-zarray_t* gradient_clusters(apriltag_detector_t *td, image_u8_t* threshim, int w, int h, int ts, unionfind_t* uf) {
-    zarray_t* clusters;
-    int nclustermap = 0.2*w*h;
+// A cluster found by one task is used where it is; one split between
+// tasks is copied into a single array.
+static void do_cluster_assemble_task(void *p)
+{
+    struct cluster_merge_task *task = (struct cluster_merge_task*) p;
+    const struct cluster_ref *refs = task->merged;
+    struct pt *split_pts = task->split_pts;
+    int n = task->nrefs;
+
+    zarray_t *cluster = task->headers;
+    for (int i = 0; i < n; cluster++) {
+        int j = i + 1;
+        while (j < n && refs[j].id == refs[i].id)
+            j++;
+
+        cluster->el_sz = sizeof(struct pt);
+        if (j == i + 1) {
+            cluster->data = (char*) refs[i].pts;
+            cluster->size = refs[i].npts;
+        } else {
+            cluster->data = (char*) split_pts;
+            cluster->size = 0;
+            for (int k = i; k < j; k++) {
+                memcpy(&split_pts[cluster->size], refs[k].pts, sizeof(struct pt)*refs[k].npts);
+                cluster->size += refs[k].npts;
+            }
+            split_pts += cluster->size;
+        }
+        cluster->alloc = cluster->size;
+
+        i = j;
+    }
+}
 
+// Returns the clusters as arrays of struct pt. The arrays are views
+// into the workspace, valid until the next frame: they must not be
+// resized or destroyed (only the returned list must be destroyed).
+// returns NULL if the clusters cannot be allocated.
+zarray_t* gradient_clusters(apriltag_detector_t *td, struct thresh_image* threshim, int w, int h, unionfind_t* uf) {
+    struct apriltag_workspace *ws = td->ws;
     int sz = h - 1;
-    int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
-    struct cluster_task *tasks = malloc(sizeof(struct cluster_task)*(sz / chunksize + 1));
+    int64_t utime0 = utime_now();
+    int chunksize = apriltag_task_chunksize(td, APRILTAG_STAGE_CLUSTERS, sz);
+    struct cluster_task *tasks = ws_reserve(&ws->cluster_tasks, sizeof(struct cluster_task)*(sz / chunksize + 1));
+    if (!tasks)
+        return NULL;
+
+    if (ws->ncluster_maps < sz / chunksize + 1) {
+        int n = sz / chunksize + 1;
+        struct cluster_map *maps = realloc(ws->cluster_maps, sizeof(struct cluster_map)*n);
+        if (!maps) {
+            debug_print("Memory allocation failed\n");
+            return NULL;
+        }
+        ws->cluster_maps = maps;
+        memset(&ws->cluster_maps[ws->ncluster_maps], 0, sizeof(struct cluster_map)*(n - ws->ncluster_maps));
+        ws->ncluster_maps = n;
+    }
 
     int ntasks = 0;
 
@@ -1764,49 +3253,125 @@ zarray_t* gradient_clusters(apriltag_detector_t *td, image_u8_t* threshim, int w
         tasks[ntasks].y0 = i;
         tasks[ntasks].y1 = imin(sz, i + chunksize);
         tasks[ntasks].w = w;
-        tasks[ntasks].s = ts;
         tasks[ntasks].uf = uf;
         tasks[ntasks].im = threshim;
-        tasks[ntasks].nclustermap = nclustermap/(sz / chunksize + 1);
-        tasks[ntasks].clusters = zarray_create(sizeof(struct cluster_hash*));
-
-        workerpool_add_task(td->wp, do_cluster_task, &tasks[ntasks]);
+        tasks[ntasks].aggregate = td->qtp.aggregate_points;
+        tasks[ntasks].map = &ws->cluster_maps[ntasks];
+        if (cluster_map_reset(tasks[ntasks].map) != 0)
+            return NULL;
         ntasks++;
     }
 
+    for (int i = 0; i < ntasks; i++)
+        workerpool_add_task(td->wp, do_cluster_task, &tasks[i]);
+
     workerpool_run(td->wp);
 
-    zarray_t** clusters_list = malloc(sizeof(zarray_t *)*ntasks);
+    apriltag_task_timing(td, APRILTAG_STAGE_CLUSTERS, sz, ntasks, utime0);
+
     for (int i = 0; i < ntasks; i++) {
-        clusters_list[i] = tasks[i].clusters;
+        if (ws->cluster_maps[i].failed)
+            return NULL;
     }
 
-    int length = ntasks;
-    while (length > 1) {
-        int write = 0;
-        for (int i = 0; i < length - 1; i += 2) {
-            clusters_list[write] = merge_clusters(clusters_list[i], clusters_list[i + 1]);
-            write++;
+    // merge the lists of the tasks. The range of ids is split into
+    // partitions holding about as many clusters each, which are merged
+    // and assembled in parallel.
+    int nrefs = 0;
+    for (int i = 0; i < ntasks; i++)
+        nrefs += ws->cluster_maps[i].nrefs;
+
+    utime0 = utime_now();
+    int partsz = apriltag_task_chunksize(td, APRILTAG_STAGE_CLUSTER_MERGE, nrefs);
+    int nparts = imax(1, (nrefs + partsz - 1) / partsz);
+
+    // pick the splitting ids from a sorted sample of all the lists.
+    int step = 1 + nrefs / (8*nparts);
+    uint64_t *sample = ws_reserve(&ws->cluster_sample, sizeof(uint64_t)*(nrefs / step + ntasks));
+    struct cluster_merge_task *parts = ws_reserve(&ws->cluster_merge_tasks, sizeof(struct cluster_merge_task)*nparts);
+    int *starts = ws_reserve(&ws->cluster_bounds, sizeof(int)*(2*nparts + 1)*(ntasks + 1));
+    struct cluster_ref *refs = ws_reserve(&ws->cluster_refs[0], sizeof(struct cluster_ref)*nrefs);
+    struct cluster_ref *tmp = ws_reserve(&ws->cluster_refs[1], sizeof(struct cluster_ref)*nrefs);
+    if (!sample || !parts || !starts || !refs || !tmp)
+        return NULL;
+
+    int nsample = 0;
+    for (int i = 0; i < ntasks; i++) {
+        const struct cluster_ref *refs = ws->cluster_maps[i].refs.data;
+        for (int j = step / 2; j < ws->cluster_maps[i].nrefs; j += step)
+            sample[nsample++] = refs[j].id;
+    }
+    qsort(sample, nsample, sizeof(uint64_t), u64_compare);
+
+    int *bounds = &starts[(nparts + 1)*(ntasks + 1)];
+
+    // starts[p*(ntasks+1) + i] is where partition p begins in list i.
+    for (int p = 0; p <= nparts; p++) {
+        for (int i = 0; i < ntasks; i++) {
+            const struct cluster_ref *list = ws->cluster_maps[i].refs.data;
+            int n = ws->cluster_maps[i].nrefs;
+            int start;
+            if (p == 0) {
+                start = 0;
+            } else if (p == nparts) {
+                start = n;
+            } else {
+                uint64_t split = sample[(int64_t) p * nsample / nparts];
+                start = cluster_refs_lower_bound(list, n, split);
+            }
+            starts[p*(ntasks + 1) + i] = start;
         }
+    }
 
-        if (length % 2) {
-            clusters_list[write] = clusters_list[length - 1];
-        }
+    int ref0 = 0;
+    for (int p = 0; p < nparts; p++) {
+        parts[p].maps = ws->cluster_maps;
+        parts[p].nmaps = ntasks;
+        parts[p].starts = &starts[p*(ntasks + 1)];
+        parts[p].ends = &starts[(p + 1)*(ntasks + 1)];
+        parts[p].bounds = &bounds[p*(ntasks + 1)];
+        parts[p].refs = &refs[ref0];
+        parts[p].tmp = &tmp[ref0];
+
+        parts[p].nrefs = 0;
+        for (int i = 0; i < ntasks; i++)
+            parts[p].nrefs += parts[p].ends[i] - parts[p].starts[i];
+        ref0 += parts[p].nrefs;
+
+        workerpool_add_task(td->wp, do_cluster_merge_task, &parts[p]);
+    }
+    workerpool_run(td->wp);
+
+    int nclusters = 0, nsplit = 0;
+    for (int p = 0; p < nparts; p++) {
+        nclusters += parts[p].nclusters;
+        nsplit += parts[p].nsplit;
+    }
 
-        length = (length >> 1) + length % 2;
+    struct pt *split_pts = ws_reserve(&ws->cluster_pts, sizeof(struct pt)*nsplit);
+    zarray_t *headers = ws_reserve(&ws->cluster_headers, sizeof(zarray_t)*nclusters);
+    if (!split_pts || !headers)
+        return NULL;
+
+    for (int p = 0, c = 0, sp = 0; p < nparts; p++) {
+        parts[p].headers = &headers[c];
+        parts[p].split_pts = &split_pts[sp];
+        c += parts[p].nclusters;
+        sp += parts[p].nsplit;
+
+        workerpool_add_task(td->wp, do_cluster_assemble_task, &parts[p]);
     }
+    workerpool_run(td->wp);
 
-    clusters = zarray_create(sizeof(zarray_t*));
-    zarray_ensure_capacity(clusters, zarray_size(clusters_list[0]));
-    for (int i = 0; i < zarray_size(clusters_list[0]); i++) {
-        struct cluster_hash** hash;
-        zarray_get_volatile(clusters_list[0], i, &hash);
-        zarray_add(clusters, &(*hash)->data);
-        free(*hash);
+    apriltag_task_timing(td, APRILTAG_STAGE_CLUSTER_MERGE, nrefs, nparts, utime0);
+
+    zarray_t *clusters = zarray_create(sizeof(zarray_t*));
+    zarray_ensure_capacity(clusters, nclusters);
+    for (int i = 0; i < nclusters; i++) {
+        zarray_t *cluster = &headers[i];
+        zarray_add(clusters, &cluster);
     }
-    zarray_destroy(clusters_list[0]);
-    free(clusters_list);
-    free(tasks);
+
     return clusters;
 }
 
@@ -1832,8 +3397,38 @@ zarray_t* fit_quads(apriltag_detector_t *td, int w, int h, zarray_t* clusters, i
     }
 
     int sz = zarray_size(clusters);
-    int chunksize = 1 + sz / (APRILTAG_TASKS_PER_THREAD_TARGET * td->nthreads);
-    struct quad_task *tasks = malloc(sizeof(struct quad_task)*(sz / chunksize + 1));
+    int64_t utime0 = utime_now();
+    int chunksize = apriltag_task_chunksize(td, APRILTAG_STAGE_QUADS, sz);
+    struct apriltag_workspace *ws = td->ws;
+    struct quad_task *tasks = ws_reserve(&ws->quad_tasks, sizeof(struct quad_task)*(sz / chunksize + 1));
+    if (!tasks)
+        return quads;
+    if (ws->nquad_scratch < sz / chunksize + 1) {
+        int n = sz / chunksize + 1;
+        struct fit_quad_scratch *scratch = realloc(ws->quad_scratch, sizeof(struct fit_quad_scratch)*n);
+        if (!scratch) {
+            debug_print("Memory allocation failed\n");
+            return quads;
+        }
+        ws->quad_scratch = scratch;
+        memset(&ws->quad_scratch[ws->nquad_scratch], 0, sizeof(struct fit_quad_scratch)*(n - ws->nquad_scratch));
+        ws->nquad_scratch = n;
+    }
+
+    // each task adds the quads it finds to a list of its own, and the
+    // lists are joined in task order, so that the order of the quads
+    // does not depend on how the tasks ran.
+    if (ws->ntask_quads < sz / chunksize + 1) {
+        int n = sz / chunksize + 1;
+        zarray_t **task_quads = realloc(ws->task_quads, sizeof(zarray_t*)*n);
+        if (!task_quads) {
+            debug_print("Memory allocation failed\n");
+            return quads;
+        }
+        ws->task_quads = task_quads;
+        for (; ws->ntask_quads < n; ws->ntask_quads++)
+            ws->task_quads[ws->ntask_quads] = zarray_create(sizeof(struct quad));
+    }
 
     int ntasks = 0;
     for (int i = 0; i < sz; i += chunksize) {
@@ -1842,12 +3437,14 @@ zarray_t* fit_quads(apriltag_detector_t *td, int w, int h, zarray_t* clusters, i
         tasks[ntasks].cidx1 = imin(sz, i + chunksize);
         tasks[ntasks].h = h;
         tasks[ntasks].w = w;
-        tasks[ntasks].quads = quads;
+        tasks[ntasks].quads = ws->task_quads[ntasks];
+        zarray_clear(tasks[ntasks].quads);
         tasks[ntasks].clusters = clusters;
         tasks[ntasks].im = im;
         tasks[ntasks].tag_width = min_tag_width;
         tasks[ntasks].normal_border = normal_border;
         tasks[ntasks].reversed_border = reversed_border;
+        tasks[ntasks].scratch = &ws->quad_scratch[ntasks];
 
         workerpool_add_task(td->wp, do_quad_task, &tasks[ntasks]);
         ntasks++;
@@ -1855,7 +3452,14 @@ zarray_t* fit_quads(apriltag_detector_t *td, int w, int h, zarray_t* clusters, i
 
     workerpool_run(td->wp);
 
-    free(tasks);
+    apriltag_task_timing(td, APRILTAG_STAGE_QUADS, sz, ntasks, utime0);
+
+    int nquads = 0;
+    for (int i = 0; i < ntasks; i++)
+        nquads += zarray_size(tasks[i].quads);
+    zarray_ensure_capacity(quads, nquads);
+    for (int i = 0; i < ntasks; i++)
+        zarray_add_range(quads, tasks[i].quads, 0, zarray_size(tasks[i].quads));
 
     return quads;
 }
@@ -1867,26 +3471,39 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
 
     int w = im->width, h = im->height;
 
-    image_u8_t *threshim = threshold(td, im);
-    int ts = threshim->stride;
+    // if a stage cannot allocate its buffers, no quads are found.
+    struct thresh_image *threshim = threshold(td, im);
+    if (!threshim)
+        return zarray_create(sizeof(struct quad));
 
-    if (td->debug)
-        image_u8_write_pnm(threshim, "debug_threshold.pnm");
+    if (td->debug) {
+        image_u8_t *im8 = image_u8_create(w, h);
+        for (int y = 0; y < h; y++)
+            thresh_image_unpack_row(threshim, y, &im8->buf[y*im8->stride]);
+        image_u8_write_pnm(im8, "debug_threshold.pnm");
+        image_u8_destroy(im8);
+    }
 
 
     ////////////////////////////////////////////////////////
     // step 2. find connected components.
-    unionfind_t* uf = connected_components(td, threshim, w, h, ts);
+    unionfind_t* uf = connected_components(td, threshim, w, h);
+    if (!uf)
+        return zarray_create(sizeof(struct quad));
 
     // make segmentation image.
     if (td->debug) {
         image_u8x3_t *d = image_u8x3_create(w, h);
 
-        uint32_t *colors = (uint32_t*) calloc(w*h, sizeof(*colors));
+        uint32_t *colors = (uint32_t*) calloc(threshim->row_runs[h], sizeof(*colors));
 
         for (int y = 0; y < h; y++) {
+            uint32_t cursor = threshim->row_runs[y];
             for (int x = 0; x < w; x++) {
-                uint32_t v = unionfind_get_representative(uf, y*w+x);
+                if (!((threshim->valid[y*threshim->stride + x / 64] >> (x & 63)) & 1))
+                    continue;
+
+                uint32_t v = unionfind_get_representative(uf, run_at(threshim->runs, &cursor, x));
 
                 if ((int)unionfind_get_set_size(uf, v) < td->qtp.min_cluster_pixels)
                     continue;
@@ -1919,7 +3536,9 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
 
     timeprofile_stamp(td->tp, "unionfind");
 
-    zarray_t* clusters = gradient_clusters(td, threshim, w, h, ts, uf);
+    zarray_t* clusters = gradient_clusters(td, threshim, w, h, uf);
+    if (!clusters)
+        return zarray_create(sizeof(struct quad));
 
     if (td->debug) {
         image_u8x3_t *d = image_u8x3_create(w, h);
@@ -1954,7 +3573,6 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
     }
 
 
-    image_u8_destroy(threshim);
     timeprofile_stamp(td->tp, "make clusters");
 
     ////////////////////////////////////////////////////////
@@ -2004,13 +3622,6 @@ zarray_t *apriltag_quad_thresh(apriltag_detector_t *td, image_u8_t *im)
 
     timeprofile_stamp(td->tp, "fit quads to clusters");
 
-    unionfind_destroy(uf);
-
-    for (int i = 0; i < zarray_size(clusters); i++) {
-        zarray_t *cluster;
-        zarray_get(clusters, i, &cluster);
-        zarray_destroy(cluster);
-    }
     zarray_destroy(clusters);
 
     return quads;
@@ -0,0 +1,61 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#include "apriltag.h"
+
+// Internal to the detector: how the stages of a detection are split
+// into tasks for the worker pool. Not installed.
+
+// Tasks shorter than this (in microseconds) cost about as much to
+// schedule as they save. See apriltag_task_chunksize.
+#define APRILTAG_MIN_TASK_USEC 20
+
+// The stages of a detection that are split into tasks, each timed to
+// size its tasks in the next frames.
+enum apriltag_stage
+{
+    APRILTAG_STAGE_THRESHOLD,
+    APRILTAG_STAGE_LOCAL_MEAN_SUMS,
+    APRILTAG_STAGE_LOCAL_MEAN,
+    APRILTAG_STAGE_RUNS,
+    APRILTAG_STAGE_UNIONFIND,
+    APRILTAG_STAGE_CLUSTERS,
+    APRILTAG_STAGE_CLUSTER_MERGE,
+    APRILTAG_STAGE_QUADS,
+    APRILTAG_STAGE_DECODE,
+    APRILTAG_NSTAGES
+};
+
+// How many of the nitems items of stage each task should process.
+int apriltag_task_chunksize(apriltag_detector_t *td, enum apriltag_stage stage, int nitems);
+
+// Records how long the ntasks tasks of stage, added at utime0, took.
+void apriltag_task_timing(apriltag_detector_t *td, enum apriltag_stage stage, int nitems, int ntasks, int64_t utime0);
@@ -31,6 +31,7 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include "common/zarray.h"
 #include "common/homography.h"
 #include "common/math_util.h"
+#include "common/simd.h"
 
 // correspondences is a list of float[4]s, consisting of the points x
 // and y concatenated. We will compute a homography such that y = Hx
@@ -477,3 +478,29 @@ void quat_to_matrix(const double q[4], matd_t *M)
     MATD_EL(M, 2, 1) = 2*y*z + 2*w*x;
     MATD_EL(M, 2, 2) = w*w - x*x - y*y + z*z;
 }
+
+void homography_project_n(const double *H, int n, const double *x, const double *y, double *ox, double *oy)
+{
+    int i = 0;
+
+#ifdef APRILTAG_HAVE_V2F64
+    v2f64 h[9];
+    for (int k = 0; k < 9; k++)
+        h[k] = v2f64_dup(H[k]);
+
+    for (; i + 2 <= n; i += 2) {
+        v2f64 vx = v2f64_load(&x[i]), vy = v2f64_load(&y[i]);
+
+        // same order of operations as homography_project_data
+        v2f64 xx = v2f64_add(v2f64_add(v2f64_mul(h[0], vx), v2f64_mul(h[1], vy)), h[2]);
+        v2f64 yy = v2f64_add(v2f64_add(v2f64_mul(h[3], vx), v2f64_mul(h[4], vy)), h[5]);
+        v2f64 zz = v2f64_add(v2f64_add(v2f64_mul(h[6], vx), v2f64_mul(h[7], vy)), h[8]);
+
+        v2f64_store(&ox[i], v2f64_div(xx, zz));
+        v2f64_store(&oy[i], v2f64_div(yy, zz));
+    }
+#endif
+
+    for (; i < n; i++)
+        homography_project_data(H, x[i], y[i], &ox[i], &oy[i]);
+}
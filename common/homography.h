@@ -141,6 +141,22 @@ static inline void homography_project(const matd_t *H, double x, double y, doubl
     *oy = yy / zz;
 }
 
+// like homography_project, for a 3x3 homography stored row-major in a
+// plain array.
+static inline void homography_project_data(const double *H, double x, double y, double *ox, double *oy)
+{
+    double xx = H[0]*x + H[1]*y + H[2];
+    double yy = H[3]*x + H[4]*y + H[5];
+    double zz = H[6]*x + H[7]*y + H[8];
+
+    *ox = xx / zz;
+    *oy = yy / zz;
+}
+
+// homography_project_data for the n points (x[i], y[i]), with the same
+// results, computed several points at a time.
+void homography_project_n(const double *H, int n, const double *x, const double *y, double *ox, double *oy);
+
 // assuming that the projection matrix is:
 // [ fx 0  cx 0 ]
 // [  0 fy cy 0 ]
@@ -437,13 +437,37 @@ image_u8_t *image_u8_rotate(const image_u8_t *in, double rad, uint8_t pad)
 }
 
 image_u8_t *image_u8_decimate(image_u8_t *im, float ffactor)
+{
+    return image_u8_decimate_reuse(im, ffactor, NULL);
+}
+
+// decim is reused if it has the right size, otherwise it is replaced
+// by a new image. Returns NULL if that cannot be allocated.
+static image_u8_t *decimate_target(image_u8_t *decim, int swidth, int sheight)
+{
+    if (decim != NULL && decim->width == swidth && decim->height == sheight)
+        return decim;
+
+    if (decim != NULL)
+        image_u8_destroy(decim);
+    decim = image_u8_create(swidth, sheight);
+    if (decim != NULL && decim->buf == NULL) {
+        image_u8_destroy(decim);
+        decim = NULL;
+    }
+    return decim;
+}
+
+image_u8_t *image_u8_decimate_reuse(image_u8_t *im, float ffactor, image_u8_t *decim)
 {
     int width = im->width, height = im->height;
 
     if (ffactor == 1.5) {
         int swidth = width / 3 * 2, sheight = height / 3 * 2;
 
-        image_u8_t *decim = image_u8_create(swidth, sheight);
+        decim = decimate_target(decim, swidth, sheight);
+        if (decim == NULL)
+            return NULL;
 
         int y = 0, sy = 0;
         while (sy < sheight) {
@@ -490,7 +514,9 @@ image_u8_t *image_u8_decimate(image_u8_t *im, float ffactor)
 
     int swidth = 1 + (width - 1)/factor;
     int sheight = 1 + (height - 1)/factor;
-    image_u8_t *decim = image_u8_create(swidth, sheight);
+    decim = decimate_target(decim, swidth, sheight);
+    if (decim == NULL)
+        return NULL;
     int sy = 0;
     for (int y = 0; y < height; y += factor) {
         int sx = 0;
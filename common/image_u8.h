@@ -72,6 +72,11 @@ void image_u8_gaussian_blur(image_u8_t *im, double sigma, int k);
 
 // 1.5, 2, 3, 4, ... supported
 image_u8_t *image_u8_decimate(image_u8_t *im, float factor);
+// Same as image_u8_decimate, but writes into decim (which may be NULL)
+// when it already has the size of the result. Otherwise decim is
+// destroyed and a new image is returned, or NULL if that cannot be
+// allocated.
+image_u8_t *image_u8_decimate_reuse(image_u8_t *im, float factor, image_u8_t *decim);
 
 void image_u8_destroy(image_u8_t *im);
 
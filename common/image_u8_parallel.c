@@ -25,9 +25,12 @@ of the authors and should not be interpreted as representing official policies,
 either expressed or implied, of the Regents of The University of Michigan.
 */
 
+#include <stdbool.h>
+
 #include "common/image_u8_parallel.h"
 #include "common/workerpool.h"
 #include "common/math_util.h"
+#include "common/simd.h"
 
 static void convolve(const uint8_t *x, uint8_t *y, int sz, const uint8_t *k, int ksz)
 {
@@ -145,10 +148,10 @@ void image_u8_convolve_2D_parallel(workerpool_t *wp, image_u8_t *im, const uint8
     free(params);
 }
 
-void image_u8_gaussian_blur_parallel(workerpool_t *wp, image_u8_t *im, double sigma, int ksz) {
-    if (sigma == 0)
-        return;
-
+// builds a gaussian kernel of ksz (odd) 8 bit weights adding up to at
+// most 255, to be freed by the caller.
+static uint8_t *gaussian_kernel(double sigma, int ksz)
+{
     assert((ksz & 1) == 1); // ksz must be odd.
 
     // build the kernel.
@@ -175,7 +178,205 @@ void image_u8_gaussian_blur_parallel(workerpool_t *wp, image_u8_t *im, double si
         k[i] = dk[i]*255;
 
     free(dk);
+    return k;
+}
+
+void image_u8_gaussian_blur_parallel(workerpool_t *wp, image_u8_t *im, double sigma, int ksz) {
+    if (sigma == 0)
+        return;
 
+    uint8_t *k = gaussian_kernel(sigma, ksz);
     image_u8_convolve_2D_parallel(wp, im, k, ksz);
     free(k);
 }
+
+// Convolves the samples [r, sz - r - trim) of x with k (of size
+// 2r+1) into y, and copies the others. trim is 1 to match
+// image_u8_convolve_2D, which also copies the last sample it could
+// convolve, and 0 to match image_u8_convolve_2D_parallel.
+static void convolve_trim(const uint8_t *x, uint8_t *y, int sz, const uint8_t *k, int ksz, int trim)
+{
+    int r = ksz/2;
+    int i0 = imin(r, sz), i1 = imax(i0, sz - r - trim);
+
+    memcpy(y, x, i0);
+
+    int i = i0;
+#ifdef APRILTAG_HAVE_V16
+    for (; i + 16 <= i1; i += 16) {
+        v8u16 lo = v8u16_zero(), hi = v8u16_zero();
+        for (int j = 0; j < ksz; j++) {
+            v16u8 v = v16_load(&x[i - r + j]);
+            lo = v8u16_mla_lo(lo, v, k[j]);
+            hi = v8u16_mla_hi(hi, v, k[j]);
+        }
+        v16_store(&y[i], v8u16_shr8_narrow(lo, hi));
+    }
+#endif
+    for (; i < i1; i++) {
+        uint32_t acc = 0;
+
+        for (int j = 0; j < ksz; j++)
+            acc += k[j]*x[i - r + j];
+
+        y[i] = acc >> 8;
+    }
+
+    memcpy(&y[i1], &x[i1], sz - i1);
+}
+
+// Sharpens the row orig, of w pixels, to 2*orig - blur (clamped), where
+// blur is rows[ksz/2] if !convolve, and the sum of rows[0..ksz)
+// weighted by k otherwise.
+static void sharpen_row(uint8_t *orig, const uint8_t **rows, int w, const uint8_t *k, int ksz, bool convolve)
+{
+    int x = 0;
+#ifdef APRILTAG_HAVE_V16
+    for (; x + 16 <= w; x += 16) {
+        v16u8 blur;
+        if (convolve) {
+            v8u16 lo = v8u16_zero(), hi = v8u16_zero();
+            for (int j = 0; j < ksz; j++) {
+                v16u8 v = v16_load(&rows[j][x]);
+                lo = v8u16_mla_lo(lo, v, k[j]);
+                hi = v8u16_mla_hi(hi, v, k[j]);
+            }
+            blur = v8u16_shr8_narrow(lo, hi);
+        } else {
+            blur = v16_load(&rows[ksz/2][x]);
+        }
+
+        // 2*v - blur is v + (v - blur) where v >= blur, and
+        // v - (blur - v) elsewhere.
+        v16u8 v = v16_load(&orig[x]);
+        v16_store(&orig[x], v16_subs(v16_adds(v, v16_subs(v, blur)), v16_subs(blur, v)));
+    }
+#endif
+    for (; x < w; x++) {
+        int blur;
+        if (convolve) {
+            uint32_t acc = 0;
+            for (int j = 0; j < ksz; j++)
+                acc += k[j]*rows[j][x];
+            blur = acc >> 8;
+        } else {
+            blur = rows[ksz/2][x];
+        }
+
+        int v = 2*orig[x] - blur;
+        if (v < 0)
+            v = 0;
+        if (v > 255)
+            v = 255;
+        orig[x] = (uint8_t) v;
+    }
+}
+
+// Sharpens a band of rows [y0, y1) in place. The blurred rows within
+// ksz/2 of the band, which other bands sharpen meanwhile, must have
+// been computed first (see do_unsharp_halo_task). The band's own rows
+// are blurred horizontally just ahead of the row being sharpened, and
+// kept in a ring of ksz rows.
+struct image_u8_unsharp_task {
+    image_u8_t *im;
+    const uint8_t *k;
+    int ksz;
+    int trim;
+    int y0, y1;
+
+    // the rows [y0 - ksz/2, y0), then [y1, y1 + ksz/2), blurred
+    // horizontally. (Those outside the image are not used.)
+    uint8_t *halo;
+};
+
+static void do_unsharp_halo_task(void *p)
+{
+    struct image_u8_unsharp_task *task = (struct image_u8_unsharp_task*) p;
+    image_u8_t *im = task->im;
+    int r = task->ksz/2, w = im->width;
+
+    for (int i = 0; i < 2*r; i++) {
+        int y = i < r ? task->y0 - r + i : task->y1 + i - r;
+        if (y >= 0 && y < im->height)
+            convolve_trim(&im->buf[y*im->stride], &task->halo[i*w], w, task->k, task->ksz, task->trim);
+    }
+}
+
+static void do_unsharp_task(void *p)
+{
+    struct image_u8_unsharp_task *task = (struct image_u8_unsharp_task*) p;
+    image_u8_t *im = task->im;
+    int ksz = task->ksz, r = ksz/2, w = im->width, h = im->height;
+
+    uint8_t *ring = malloc(sizeof(uint8_t)*ksz*w);
+    const uint8_t **rows = malloc(sizeof(uint8_t*)*ksz);
+
+    int next = task->y0; // the next row of the band to blur horizontally
+    for (int y = task->y0; y < task->y1; y++) {
+        for (; next <= imin(y + r, task->y1 - 1); next++)
+            convolve_trim(&im->buf[next*im->stride], &ring[(next % ksz)*w], w, task->k, ksz, task->trim);
+
+        // as in convolve_trim, vertically.
+        bool convolve = y >= r && y < h - r - task->trim;
+        for (int j = 0; j < ksz; j++) {
+            int yy = y - r + j;
+            if (!convolve && yy != y)
+                continue;
+
+            if (yy < task->y0)
+                rows[j] = &task->halo[(yy - (task->y0 - r))*w];
+            else if (yy >= task->y1)
+                rows[j] = &task->halo[(r + yy - task->y1)*w];
+            else
+                rows[j] = &ring[(yy % ksz)*w];
+        }
+
+        sharpen_row(&im->buf[y*im->stride], rows, w, task->k, ksz, convolve);
+    }
+
+    free(ring);
+    free(rows);
+}
+
+void image_u8_unsharp_mask_parallel(workerpool_t *wp, image_u8_t *im, double sigma, int ksz)
+{
+    if (sigma == 0)
+        return;
+
+    uint8_t *k = gaussian_kernel(sigma, ksz);
+    int r = ksz/2, w = im->width, h = im->height;
+
+    // like image_u8_convolve_2D_parallel, which blurs small images
+    // single threaded.
+    bool small = w * h < 65536;
+    int nbands = small ? 1 : imin(workerpool_get_nthreads(wp), h);
+
+    struct image_u8_unsharp_task *tasks = malloc(sizeof(struct image_u8_unsharp_task)*nbands);
+    uint8_t *halo = nbands > 1 ? malloc(sizeof(uint8_t)*nbands*2*r*w) : NULL;
+
+    for (int i = 0; i < nbands; i++) {
+        tasks[i].im = im;
+        tasks[i].k = k;
+        tasks[i].ksz = ksz;
+        tasks[i].trim = small ? 1 : 0;
+        tasks[i].y0 = h*i / nbands;
+        tasks[i].y1 = h*(i + 1) / nbands;
+        tasks[i].halo = nbands > 1 ? &halo[i*2*r*w] : NULL;
+    }
+
+    if (nbands > 1) {
+        for (int i = 0; i < nbands; i++)
+            workerpool_add_task(wp, do_unsharp_halo_task, &tasks[i]);
+        workerpool_run(wp);
+
+        for (int i = 0; i < nbands; i++)
+            workerpool_add_task(wp, do_unsharp_task, &tasks[i]);
+        workerpool_run(wp);
+    } else {
+        do_unsharp_task(&tasks[0]);
+    }
+
+    free(halo);
+    free(tasks);
+    free(k);
+}
@@ -34,3 +34,9 @@ either expressed or implied, of the Regents of The University of Michigan.
 void image_u8_convolve_2D_parallel(workerpool_t *wp, image_u8_t *im, const uint8_t *k, int ksz);
 
 void image_u8_gaussian_blur_parallel(workerpool_t *wp, image_u8_t *im, double sigma, int ksz);
+
+// Sharpens im in place to 2*im - blur (clamped), where blur is what
+// image_u8_gaussian_blur_parallel would turn im into. Rather than
+// blurring a copy of the image, it works in bands of rows that only
+// keep a few blurred rows each.
+void image_u8_unsharp_mask_parallel(workerpool_t *wp, image_u8_t *im, double sigma, int ksz);
@@ -0,0 +1,306 @@
+/* Copyright (C) 2013-2016, The Regents of The University of Michigan.
+All rights reserved.
+This software was developed in the APRIL Robotics Lab under the
+direction of Edwin Olson, ebolson@umich.edu. This software may be
+available under alternative licensing terms; contact the address above.
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the Regents of The University of Michigan.
+*/
+
+#pragma once
+
+// Minimal 16 x uint8 vector helpers shared by the pixel kernels. SSE2
+// and NEON are part of the baseline instruction set on x86-64 and
+// AArch64, so these are selected at compile time. Wider AVX2 kernels
+// are compiled with a target attribute and selected at run time with
+// simd_cpu_has_avx2(). Define APRILTAG_DISABLE_SIMD to force the scalar
+// reference implementations.
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef APRILTAG_DISABLE_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define APRILTAG_HAVE_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define APRILTAG_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define APRILTAG_HAVE_AVX2_DISPATCH 1
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(APRILTAG_HAVE_SSE2) || defined(APRILTAG_HAVE_NEON)
+#define APRILTAG_HAVE_V16 1
+#endif
+
+#ifdef APRILTAG_HAVE_AVX2_DISPATCH
+static inline int simd_cpu_has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+static inline int simd_cpu_has_popcnt(void)
+{
+    return __builtin_cpu_supports("popcnt");
+}
+#endif
+
+static inline uint32_t simd_load_u32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void simd_store_u32(uint8_t *p, uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+static inline int simd_popcount64(uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(v);
+#else
+    int n = 0;
+    for (; v; v &= v - 1)
+        n++;
+    return n;
+#endif
+}
+
+// index of the lowest set bit; v must not be zero.
+static inline int simd_ctz64(uint64_t v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(v);
+#else
+    int n = 0;
+    while (!(v & 1)) {
+        v >>= 1;
+        n++;
+    }
+    return n;
+#endif
+}
+
+#if defined(APRILTAG_HAVE_SSE2)
+
+typedef __m128i v16u8;
+
+static inline v16u8 v16_load(const uint8_t *p) { return _mm_loadu_si128((const __m128i*) p); }
+static inline void v16_store(uint8_t *p, v16u8 v) { _mm_storeu_si128((__m128i*) p, v); }
+static inline v16u8 v16_dup(uint8_t v) { return _mm_set1_epi8((char) v); }
+static inline v16u8 v16_max(v16u8 a, v16u8 b) { return _mm_max_epu8(a, b); }
+static inline v16u8 v16_min(v16u8 a, v16u8 b) { return _mm_min_epu8(a, b); }
+static inline v16u8 v16_and(v16u8 a, v16u8 b) { return _mm_and_si128(a, b); }
+static inline v16u8 v16_or(v16u8 a, v16u8 b) { return _mm_or_si128(a, b); }
+// ~a & b
+static inline v16u8 v16_andnot(v16u8 a, v16u8 b) { return _mm_andnot_si128(a, b); }
+static inline v16u8 v16_eq(v16u8 a, v16u8 b) { return _mm_cmpeq_epi8(a, b); }
+static inline v16u8 v16_adds(v16u8 a, v16u8 b) { return _mm_adds_epu8(a, b); }
+static inline v16u8 v16_subs(v16u8 a, v16u8 b) { return _mm_subs_epu8(a, b); }
+static inline v16u8 v16_shr1(v16u8 a) { return _mm_and_si128(_mm_srli_epi16(a, 1), _mm_set1_epi8(0x7f)); }
+
+// unsigned a > b, as 0xff / 0x00 lanes
+static inline v16u8 v16_gt(v16u8 a, v16u8 b)
+{
+    const __m128i bias = _mm_set1_epi8((char) 0x80);
+    return _mm_cmpgt_epi8(_mm_xor_si128(a, bias), _mm_xor_si128(b, bias));
+}
+
+// max (resp. min) of each group of four consecutive bytes, packed
+// into the four bytes of the result.
+static inline uint32_t v16_hmax4(v16u8 v)
+{
+    v = _mm_max_epu8(v, _mm_srli_epi32(v, 8));
+    v = _mm_max_epu8(v, _mm_srli_epi32(v, 16));
+    v = _mm_and_si128(v, _mm_set1_epi32(0xff));
+    v = _mm_packs_epi32(v, v);
+    v = _mm_packus_epi16(v, v);
+    return (uint32_t) _mm_cvtsi128_si32(v);
+}
+
+static inline uint32_t v16_hmin4(v16u8 v)
+{
+    v = _mm_min_epu8(v, _mm_srli_epi32(v, 8));
+    v = _mm_min_epu8(v, _mm_srli_epi32(v, 16));
+    v = _mm_and_si128(v, _mm_set1_epi32(0xff));
+    v = _mm_packs_epi32(v, v);
+    v = _mm_packus_epi16(v, v);
+    return (uint32_t) _mm_cvtsi128_si32(v);
+}
+
+// inverse of the above: each of the four bytes repeated four times.
+static inline v16u8 v16_expand4(uint32_t v)
+{
+    __m128i x = _mm_cvtsi32_si128((int) v);
+    x = _mm_unpacklo_epi8(x, x);
+    return _mm_unpacklo_epi16(x, x);
+}
+
+// one bit per lane of a 0xff / 0x00 mask, lane 0 in the lowest bit.
+static inline uint32_t v16_movemask(v16u8 m)
+{
+    return (uint32_t) _mm_movemask_epi8(m);
+}
+
+// 8 x uint16, for sums of bytes weighted by bytes (which cannot
+// overflow while the weights add up to at most 257).
+typedef __m128i v8u16;
+
+static inline v8u16 v8u16_zero(void) { return _mm_setzero_si128(); }
+// a + k * (the low, resp. high, eight bytes of b)
+static inline v8u16 v8u16_mla_lo(v8u16 a, v16u8 b, uint8_t k)
+{
+    return _mm_add_epi16(a, _mm_mullo_epi16(_mm_unpacklo_epi8(b, _mm_setzero_si128()), _mm_set1_epi16(k)));
+}
+static inline v8u16 v8u16_mla_hi(v8u16 a, v16u8 b, uint8_t k)
+{
+    return _mm_add_epi16(a, _mm_mullo_epi16(_mm_unpackhi_epi8(b, _mm_setzero_si128()), _mm_set1_epi16(k)));
+}
+// the lanes of lo, then hi, shifted right by 8.
+static inline v16u8 v8u16_shr8_narrow(v8u16 lo, v8u16 hi)
+{
+    return _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+}
+
+#elif defined(APRILTAG_HAVE_NEON)
+
+typedef uint8x16_t v16u8;
+
+static inline v16u8 v16_load(const uint8_t *p) { return vld1q_u8(p); }
+static inline void v16_store(uint8_t *p, v16u8 v) { vst1q_u8(p, v); }
+static inline v16u8 v16_dup(uint8_t v) { return vdupq_n_u8(v); }
+static inline v16u8 v16_max(v16u8 a, v16u8 b) { return vmaxq_u8(a, b); }
+static inline v16u8 v16_min(v16u8 a, v16u8 b) { return vminq_u8(a, b); }
+static inline v16u8 v16_and(v16u8 a, v16u8 b) { return vandq_u8(a, b); }
+static inline v16u8 v16_or(v16u8 a, v16u8 b) { return vorrq_u8(a, b); }
+static inline v16u8 v16_andnot(v16u8 a, v16u8 b) { return vbicq_u8(b, a); }
+static inline v16u8 v16_eq(v16u8 a, v16u8 b) { return vceqq_u8(a, b); }
+static inline v16u8 v16_adds(v16u8 a, v16u8 b) { return vqaddq_u8(a, b); }
+static inline v16u8 v16_subs(v16u8 a, v16u8 b) { return vqsubq_u8(a, b); }
+static inline v16u8 v16_shr1(v16u8 a) { return vshrq_n_u8(a, 1); }
+static inline v16u8 v16_gt(v16u8 a, v16u8 b) { return vcgtq_u8(a, b); }
+
+static inline uint32_t v16_hmax4(v16u8 v)
+{
+    uint8x8_t p = vpmax_u8(vget_low_u8(v), vget_high_u8(v));
+    p = vpmax_u8(p, p);
+    return vget_lane_u32(vreinterpret_u32_u8(p), 0);
+}
+
+static inline uint32_t v16_hmin4(v16u8 v)
+{
+    uint8x8_t p = vpmin_u8(vget_low_u8(v), vget_high_u8(v));
+    p = vpmin_u8(p, p);
+    return vget_lane_u32(vreinterpret_u32_u8(p), 0);
+}
+
+static inline v16u8 v16_expand4(uint32_t v)
+{
+    uint8x8_t x = vreinterpret_u8_u32(vdup_n_u32(v));
+    uint8x8x2_t z = vzip_u8(x, x);
+    uint16x4x2_t zz = vzip_u16(vreinterpret_u16_u8(z.val[0]), vreinterpret_u16_u8(z.val[0]));
+    return vcombine_u8(vreinterpret_u8_u16(zz.val[0]), vreinterpret_u8_u16(zz.val[1]));
+}
+
+static inline uint32_t v16_movemask(v16u8 m)
+{
+    static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint64x2_t sums = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vandq_u8(m, vld1q_u8(weights)))));
+    return (uint32_t) (vgetq_lane_u64(sums, 0) | (vgetq_lane_u64(sums, 1) << 8));
+}
+
+typedef uint16x8_t v8u16;
+
+static inline v8u16 v8u16_zero(void) { return vdupq_n_u16(0); }
+static inline v8u16 v8u16_mla_lo(v8u16 a, v16u8 b, uint8_t k) { return vmlal_u8(a, vget_low_u8(b), vdup_n_u8(k)); }
+static inline v8u16 v8u16_mla_hi(v8u16 a, v16u8 b, uint8_t k) { return vmlal_u8(a, vget_high_u8(b), vdup_n_u8(k)); }
+static inline v16u8 v8u16_shr8_narrow(v8u16 lo, v8u16 hi)
+{
+    return vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8));
+}
+
+#endif
+
+// 2 x double, for batches of projected points. 32-bit ARM has no
+// double lanes.
+#if defined(APRILTAG_HAVE_SSE2)
+
+#define APRILTAG_HAVE_V2F64 1
+
+typedef __m128d v2f64;
+
+static inline v2f64 v2f64_load(const double *p) { return _mm_loadu_pd(p); }
+static inline void v2f64_store(double *p, v2f64 v) { _mm_storeu_pd(p, v); }
+static inline v2f64 v2f64_dup(double v) { return _mm_set1_pd(v); }
+static inline v2f64 v2f64_set(double lo, double hi) { return _mm_set_pd(hi, lo); }
+static inline v2f64 v2f64_add(v2f64 a, v2f64 b) { return _mm_add_pd(a, b); }
+static inline v2f64 v2f64_sub(v2f64 a, v2f64 b) { return _mm_sub_pd(a, b); }
+static inline v2f64 v2f64_mul(v2f64 a, v2f64 b) { return _mm_mul_pd(a, b); }
+static inline v2f64 v2f64_div(v2f64 a, v2f64 b) { return _mm_div_pd(a, b); }
+static inline v2f64 v2f64_and(v2f64 a, v2f64 b) { return _mm_and_pd(a, b); }
+// all ones where lo <= v <= hi (never for NaN).
+static inline v2f64 v2f64_in_range(v2f64 v, v2f64 lo, v2f64 hi)
+{
+    return _mm_and_pd(_mm_cmpge_pd(v, lo), _mm_cmple_pd(v, hi));
+}
+// rounded towards zero; |v| must be below 2^31.
+static inline v2f64 v2f64_trunc(v2f64 v) { return _mm_cvtepi32_pd(_mm_cvttpd_epi32(v)); }
+// one bit per lane of a mask, lane 0 in the lowest bit.
+static inline uint32_t v2f64_movemask(v2f64 m) { return (uint32_t) _mm_movemask_pd(m); }
+
+#elif defined(APRILTAG_HAVE_NEON) && defined(__aarch64__)
+
+#define APRILTAG_HAVE_V2F64 1
+
+typedef float64x2_t v2f64;
+
+static inline v2f64 v2f64_load(const double *p) { return vld1q_f64(p); }
+static inline void v2f64_store(double *p, v2f64 v) { vst1q_f64(p, v); }
+static inline v2f64 v2f64_dup(double v) { return vdupq_n_f64(v); }
+static inline v2f64 v2f64_set(double lo, double hi) { return vcombine_f64(vdup_n_f64(lo), vdup_n_f64(hi)); }
+static inline v2f64 v2f64_add(v2f64 a, v2f64 b) { return vaddq_f64(a, b); }
+static inline v2f64 v2f64_sub(v2f64 a, v2f64 b) { return vsubq_f64(a, b); }
+static inline v2f64 v2f64_mul(v2f64 a, v2f64 b) { return vmulq_f64(a, b); }
+static inline v2f64 v2f64_div(v2f64 a, v2f64 b) { return vdivq_f64(a, b); }
+static inline v2f64 v2f64_and(v2f64 a, v2f64 b)
+{
+    return vreinterpretq_f64_u64(vandq_u64(vreinterpretq_u64_f64(a), vreinterpretq_u64_f64(b)));
+}
+static inline v2f64 v2f64_in_range(v2f64 v, v2f64 lo, v2f64 hi)
+{
+    return vreinterpretq_f64_u64(vandq_u64(vcgeq_f64(v, lo), vcleq_f64(v, hi)));
+}
+static inline v2f64 v2f64_trunc(v2f64 v) { return vrndq_f64(v); }
+static inline uint32_t v2f64_movemask(v2f64 m)
+{
+    uint64x2_t u = vshrq_n_u64(vreinterpretq_u64_f64(m), 63);
+    return (uint32_t) (vgetq_lane_u64(u, 0) | (vgetq_lane_u64(u, 1) << 1));
+}
+
+#endif
@@ -30,6 +30,9 @@ either expressed or implied, of the Regents of The University of Michigan.
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 typedef struct unionfind unionfind_t;
 
@@ -37,7 +40,7 @@ typedef struct unionfind unionfind_t;
 // Accessing parent[i] and size[i] hits the same cache line.
 struct unionfind_node
 {
-    // Parent node for each. Initialized to 0xffffffff
+    // Parent node for each. Initialized to the node itself
     uint32_t parent;
     // The size of the tree excluding the root
     uint32_t size;
@@ -46,6 +49,7 @@ struct unionfind_node
 struct unionfind
 {
     uint32_t maxid;
+    uint32_t capacity; // number of nodes allocated
     struct unionfind_node *data;
 };
 
@@ -58,6 +62,20 @@ static inline uint32_t uf_load_parent(unionfind_t *uf, uint32_t id)
 #endif
 }
 
+// As uf_load_parent, but ordered before the loads that follow it, so
+// that a node read from a parent linked in another thread is seen at
+// least as that thread left it. Used by the concurrent unions.
+static inline uint32_t uf_load_parent_acquire(unionfind_t *uf, uint32_t id)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n(&uf->data[id].parent, __ATOMIC_ACQUIRE);
+#elif defined(_MSC_VER)
+    return (uint32_t) _InterlockedOr((volatile long*) &uf->data[id].parent, 0);
+#else
+    return uf->data[id].parent;
+#endif
+}
+
 static inline void uf_store_parent(unionfind_t *uf, uint32_t id, uint32_t val)
 {
 #if defined(__GNUC__) || defined(__clang__)
@@ -67,18 +85,78 @@ static inline void uf_store_parent(unionfind_t *uf, uint32_t id, uint32_t val)
 #endif
 }
 
+// Whether unionfind_connect_concurrent() may really run in several
+// threads at once with this compiler. Otherwise, its unions must be
+// done in a single thread.
+#if defined(__GNUC__) || defined(__clang__) || defined(_MSC_VER)
+#define UNIONFIND_HAVE_CONCURRENT 1
+#else
+#define UNIONFIND_HAVE_CONCURRENT 0
+#endif
+
+// Sets the parent of id to val if it is still expected, releasing
+// what this thread wrote before to the threads that then read it.
+// Returns non-zero on success.
+static inline int uf_cas_parent(unionfind_t *uf, uint32_t id, uint32_t expected, uint32_t val)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_compare_exchange_n(&uf->data[id].parent, &expected, val, 0,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+#elif defined(_MSC_VER)
+    return _InterlockedCompareExchange((volatile long*) &uf->data[id].parent,
+                                       (long) val, (long) expected) == (long) expected;
+#else
+    if (uf->data[id].parent != expected)
+        return 0;
+    uf->data[id].parent = val;
+    return 1;
+#endif
+}
+
+// Returns NULL if the nodes cannot be allocated.
 static inline unionfind_t *unionfind_create(uint32_t maxid)
 {
     unionfind_t *uf = (unionfind_t*) calloc(1, sizeof(unionfind_t));
+    if (uf == NULL)
+        return NULL;
     uf->maxid = maxid;
+    uf->capacity = maxid + 1;
     uf->data = (struct unionfind_node *) malloc((maxid+1) * sizeof(struct unionfind_node));
+    if (uf->data == NULL) {
+        free(uf);
+        return NULL;
+    }
     for (uint32_t i = 0; i <= maxid; i++) {
-        uf->data[i].parent = 0xffffffff;
+        uf->data[i].parent = i;
         uf->data[i].size = 0;
     }
     return uf;
 }
 
+// Makes uf hold the singleton sets 0..maxid again, so that it can be
+// reused instead of recreated. The nodes are only reallocated when
+// there are more of them than ever before. Returns non-zero if that
+// fails, leaving uf empty.
+static inline int unionfind_reset(unionfind_t *uf, uint32_t maxid)
+{
+    if (maxid >= uf->capacity) {
+        free(uf->data);
+        uf->data = (struct unionfind_node *) malloc(((size_t) maxid + 1) * sizeof(struct unionfind_node));
+        if (uf->data == NULL) {
+            uf->capacity = 0;
+            uf->maxid = 0;
+            return -1;
+        }
+        uf->capacity = maxid + 1;
+    }
+    uf->maxid = maxid;
+    for (uint32_t i = 0; i <= maxid; i++) {
+        uf->data[i].parent = i;
+        uf->data[i].size = 0;
+    }
+    return 0;
+}
+
 static inline void unionfind_destroy(unionfind_t *uf)
 {
     free(uf->data);
@@ -106,12 +184,6 @@ static inline uint32_t unionfind_get_representative(unionfind_t *uf, uint32_t id
 // version above.
 static inline uint32_t unionfind_get_representative(unionfind_t *uf, uint32_t id)
 {
-    // unititialized node, so set to self
-    if (uf_load_parent(uf, id) == 0xffffffff) {
-        uf_store_parent(uf, id, id);
-        return id;
-    }
-
     // Path halving: make every node point to its grandparent (single pass)
     while (uf_load_parent(uf, id) != id) {
         uf_store_parent(uf, id, uf_load_parent(uf, uf_load_parent(uf, id)));
@@ -160,3 +232,62 @@ static inline uint32_t unionfind_connect(unionfind_t *uf, uint32_t aid, uint32_t
         return broot;
     }
 }
+
+// unionfind_get_representative() for unionfind_connect_concurrent().
+// Only nodes that are not roots are shortcut, and their parents only
+// ever move closer to the root, so the stores cannot undo a link made
+// by another thread.
+static inline uint32_t unionfind_get_representative_concurrent(unionfind_t *uf, uint32_t id)
+{
+    uint32_t parent;
+    while ((parent = uf_load_parent_acquire(uf, id)) != id) {
+        uint32_t grandparent = uf_load_parent_acquire(uf, parent);
+        uf_store_parent(uf, id, grandparent);
+        id = grandparent;
+    }
+
+    return id;
+}
+
+// A union that may run in several threads at once, as long as no
+// thread calls unionfind_connect() or modifies sizes meanwhile. The
+// root with the smaller (size, id) is linked under the other with a
+// CAS, retrying if either root was linked in the meantime. Since sizes
+// do not change while this runs, the order is fixed and the root of
+// every set is deterministic, whatever the interleaving.
+//
+// Sizes are *not* updated: returns the root that was linked (or
+// 0xffffffff if aid and bid were already in the same set), which must
+// be passed to unionfind_add_linked_size() once all the concurrent
+// unions are done.
+static inline uint32_t unionfind_connect_concurrent(unionfind_t *uf, uint32_t aid, uint32_t bid)
+{
+    while (1) {
+        uint32_t aroot = unionfind_get_representative_concurrent(uf, aid);
+        uint32_t broot = unionfind_get_representative_concurrent(uf, bid);
+
+        if (aroot == broot)
+            return 0xffffffff;
+
+        uint64_t akey = ((uint64_t) uf->data[aroot].size << 32) | aroot;
+        uint64_t bkey = ((uint64_t) uf->data[broot].size << 32) | broot;
+
+        if (akey > bkey) {
+            uint32_t t = aroot;
+            aroot = broot;
+            broot = t;
+        }
+
+        if (uf_cas_parent(uf, aroot, aroot, broot))
+            return aroot;
+    }
+}
+
+// Adds the size of a tree linked by unionfind_connect_concurrent() to
+// the root of its set. Call once for every linked root; the order does
+// not matter.
+static inline void unionfind_add_linked_size(unionfind_t *uf, uint32_t linked)
+{
+    uint32_t root = unionfind_get_representative(uf, linked);
+    uf->data[root].size += uf->data[linked].size + 1;
+}
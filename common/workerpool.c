@@ -24,38 +24,88 @@ The views and conclusions contained in the software and documentation are those
 of the authors and should not be interpreted as representing official policies,
 either expressed or implied, of the Regents of The University of Michigan.
 */
+#define _GNU_SOURCE  // Possible fix for 16.04, and for sched_setaffinity
 #include <errno.h>
 
-#define _GNU_SOURCE  // Possible fix for 16.04
-#define __USE_GNU
 #include "common/pthreads_cross.h"
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #ifdef _WIN32
 #include <windows.h>
 #else
 #include <unistd.h>
 #endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #include "workerpool.h"
 #include "debug_print.h"
 
+// How many times a thread polls for the next run (a worker) or the end
+// of the current one (the caller) before it sleeps. The detector's
+// stages follow each other quickly, and waking a sleeping thread costs
+// far more than a short spin.
+#define WORKERPOOL_SPIN_ITERATIONS 4000
+
+// The tasks of a run are split among the threads, each taking them
+// from the front of its own range of the task list, and, once it is
+// empty, stealing them one at a time from the back of the others'.
+// A range [head, tail) is packed as head << 32 | tail, so that taking
+// a task from either end is a single compare-and-swap.
+struct deque
+{
+    uint64_t range;
+    char padding[56]; // keep each on its own cache line
+};
+
+struct run
+{
+    struct task *tasks;
+    uint32_t remaining; // tasks not yet done
+    uint32_t nhelpers;  // helper threads working on the run
+    struct deque *deques; // one per thread, the caller's is the first
+};
+
+struct worker
+{
+    workerpool_t *wp;
+    int id;
+
+    // the CPUs the thread may run on, or none for any.
+    int ncpus;
+    int *cpus;
+};
+
 struct workerpool {
-    int nthreads;
+    int nthreads; // including the caller of workerpool_run
     zarray_t *tasks;
-    int taskspos;
 
-    pthread_t *threads;
-    int *status;
+    // the state of the current run.
+    struct run run;
 
-    pthread_mutex_t mutex;
-    pthread_cond_t startcond;   // used to signal the availability of work
-    bool start_predicate;       // predicate that prevents spurious wakeups on startcond
-    pthread_cond_t endcond;     // used to signal completion of all work
+    // the pool whose threads run the tasks. Either this one, or the one
+    // passed to workerpool_create_shared.
+    workerpool_t *shared;
+
+    // the rest is only used in pools that own threads.
+    pthread_t *threads; // the nthreads - 1 helper threads
+    struct worker *workers;
+
+    int spin; // iterations to spin before sleeping, see workerpool_create
+
+    zarray_t *runs;       // struct run*, the ones started, guarded by mutex
+    uint32_t generation;  // incremented to start each run
+    uint32_t exiting;     // set (with generation) to stop the workers
 
-    int end_count; // how many threads are done?
+    pthread_mutex_t mutex;
+    pthread_cond_t startcond;   // used to signal the start of a run
+    uint32_t nparked;           // how many workers wait on startcond
+    pthread_cond_t endcond;     // used to signal completion of a run
 };
 
 struct task
@@ -64,94 +114,395 @@ struct task
     void *p;
 };
 
-void *worker_thread(void *p)
+#if !defined(__GNUC__) && !defined(__clang__) && !defined(_MSC_VER)
+// Without the compiler's atomic builtins, the operations below take
+// this lock instead: slower, but they stay atomic.
+static pthread_mutex_t wp_atomic_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static inline uint32_t wp_load32(uint32_t *p)
 {
-    workerpool_t *wp = (workerpool_t*) p;
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+#elif defined(_MSC_VER)
+    return (uint32_t) _InterlockedOr((volatile long*) p, 0);
+#else
+    pthread_mutex_lock(&wp_atomic_mutex);
+    uint32_t val = *p;
+    pthread_mutex_unlock(&wp_atomic_mutex);
+    return val;
+#endif
+}
+
+static inline void wp_store32(uint32_t *p, uint32_t val)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_store_n(p, val, __ATOMIC_SEQ_CST);
+#elif defined(_MSC_VER)
+    _InterlockedExchange((volatile long*) p, (long) val);
+#else
+    pthread_mutex_lock(&wp_atomic_mutex);
+    *p = val;
+    pthread_mutex_unlock(&wp_atomic_mutex);
+#endif
+}
+
+// returns the value before the addition.
+static inline uint32_t wp_fetch_add32(uint32_t *p, uint32_t val)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_fetch_add(p, val, __ATOMIC_SEQ_CST);
+#elif defined(_MSC_VER)
+    return (uint32_t) _InterlockedExchangeAdd((volatile long*) p, (long) val);
+#else
+    pthread_mutex_lock(&wp_atomic_mutex);
+    uint32_t old = *p;
+    *p = old + val;
+    pthread_mutex_unlock(&wp_atomic_mutex);
+    return old;
+#endif
+}
+
+static inline uint64_t wp_load64(uint64_t *p)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#elif defined(_MSC_VER)
+    return (uint64_t) _InterlockedCompareExchange64((volatile __int64*) p, 0, 0);
+#else
+    pthread_mutex_lock(&wp_atomic_mutex);
+    uint64_t val = *p;
+    pthread_mutex_unlock(&wp_atomic_mutex);
+    return val;
+#endif
+}
 
+// Sets *p to val if it is still *expected. Otherwise, updates
+// *expected to the value of *p. Returns non-zero on success.
+static inline int wp_cas64(uint64_t *p, uint64_t *expected, uint64_t val)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_compare_exchange_n(p, expected, val, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#elif defined(_MSC_VER)
+    uint64_t old = (uint64_t) _InterlockedCompareExchange64((volatile __int64*) p, (__int64) val,
+                                                           (__int64) *expected);
+    if (old == *expected)
+        return 1;
+    *expected = old;
+    return 0;
+#else
+    pthread_mutex_lock(&wp_atomic_mutex);
+    int success = *p == *expected;
+    if (success)
+        *p = val;
+    else
+        *expected = *p;
+    pthread_mutex_unlock(&wp_atomic_mutex);
+    return success;
+#endif
+}
+
+static inline void wp_store64(uint64_t *p, uint64_t val)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_store_n(p, val, __ATOMIC_RELEASE);
+#elif defined(_MSC_VER)
+    uint64_t expected = wp_load64(p);
+    while (!wp_cas64(p, &expected, val))
+        ;
+#else
+    pthread_mutex_lock(&wp_atomic_mutex);
+    *p = val;
+    pthread_mutex_unlock(&wp_atomic_mutex);
+#endif
+}
+
+// tells the CPU that this thread is spinning.
+static inline void wp_pause(void)
+{
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__i386__) || defined(__x86_64__))
+    __builtin_ia32_pause();
+#elif (defined(__GNUC__) || defined(__clang__)) && defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#elif defined(_MSC_VER)
+    YieldProcessor();
+#endif
+}
+
+// Takes the task at the front of the range. Returns its index, or -1
+// if the range is empty.
+static inline int64_t deque_pop_front(struct deque *d)
+{
+    uint64_t range = wp_load64(&d->range);
     while (1) {
-        struct task *task;
+        uint32_t head = range >> 32, tail = (uint32_t) range;
+        if (head >= tail)
+            return -1;
+        if (wp_cas64(&d->range, &range, ((uint64_t) (head + 1) << 32) | tail))
+            return head;
+    }
+}
 
-        pthread_mutex_lock(&wp->mutex);
-        while (wp->taskspos == zarray_size(wp->tasks) || !wp->start_predicate) {
-            wp->end_count++;
-            pthread_cond_broadcast(&wp->endcond);
-            pthread_cond_wait(&wp->startcond, &wp->mutex);
+// Takes the task at the back of the range, as pop_front.
+static inline int64_t deque_pop_back(struct deque *d)
+{
+    uint64_t range = wp_load64(&d->range);
+    while (1) {
+        uint32_t head = range >> 32, tail = (uint32_t) range;
+        if (head >= tail)
+            return -1;
+        if (wp_cas64(&d->range, &range, ((uint64_t) head << 32) | (tail - 1)))
+            return tail - 1;
+    }
+}
+
+static void run_task(struct run *run, int64_t idx)
+{
+    // read after taking the task, which orders it after the start of
+    // the run.
+    struct task *task = &run->tasks[idx];
+    task->f(task->p);
+
+    wp_fetch_add32(&run->remaining, (uint32_t) -1);
+}
+
+// Runs tasks of run as thread id, until there are none left to take.
+// (Others may still be running theirs.)
+static void run_tasks(struct run *run, int nthreads, int id)
+{
+    int64_t idx;
+    while ((idx = deque_pop_front(&run->deques[id])) >= 0)
+        run_task(run, idx);
+
+    for (int i = 1; i < nthreads; i++) {
+        struct deque *victim = &run->deques[(id + i) % nthreads];
+        while ((idx = deque_pop_back(victim)) >= 0)
+            run_task(run, idx);
+    }
+}
+
+static bool run_has_tasks(struct run *run, int nthreads)
+{
+    for (int i = 0; i < nthreads; i++) {
+        uint64_t range = wp_load64(&run->deques[i].range);
+        if ((range >> 32) < (uint32_t) range)
+            return true;
+    }
+
+    return false;
+}
+
+// Returns a started run that still has tasks to take, counting the
+// calling worker as one of its helpers, or NULL if there is none.
+static struct run *join_run(workerpool_t *wp, int id)
+{
+    struct run *res = NULL;
+
+    pthread_mutex_lock(&wp->mutex);
+    int nruns = zarray_size(wp->runs);
+    for (int i = 0; i < nruns; i++) {
+        // spread the workers over the runs.
+        struct run *run;
+        zarray_get(wp->runs, (id + i) % nruns, &run);
+        if (run_has_tasks(run, wp->nthreads)) {
+            wp_fetch_add32(&run->nhelpers, 1);
+            res = run;
+            break;
         }
+    }
+    pthread_mutex_unlock(&wp->mutex);
+
+    return res;
+}
 
-        zarray_get_volatile(wp->tasks, wp->taskspos, &task);
-        wp->taskspos++;
+static void leave_run(workerpool_t *wp, struct run *run)
+{
+    // the run cannot end before its last helper has left it, as the
+    // caller may reuse it right away.
+    if (wp_fetch_add32(&run->nhelpers, (uint32_t) -1) == 1 &&
+        wp_load32(&run->remaining) == 0) {
+        // The caller may be asleep.
+        pthread_mutex_lock(&wp->mutex);
+        pthread_cond_broadcast(&wp->endcond);
         pthread_mutex_unlock(&wp->mutex);
+    }
+}
+
+// Restricts the calling thread to the given CPUs.
+static void pin_thread(const int *cpus, int ncpus)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < ncpus; i++) {
+        if (cpus[i] >= 0 && cpus[i] < CPU_SETSIZE)
+            CPU_SET(cpus[i], &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        debug_print("Failed to set the CPU affinity of a workerpool thread\n");
+#elif defined(_WIN32)
+    DWORD_PTR mask = 0;
+    for (int i = 0; i < ncpus; i++) {
+        if (cpus[i] >= 0 && cpus[i] < (int) (8 * sizeof(mask)))
+            mask |= (DWORD_PTR) 1 << cpus[i];
+    }
+    if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0)
+        debug_print("Failed to set the CPU affinity of a workerpool thread\n");
+#else
+    (void) cpus;
+    (void) ncpus;
+    debug_print("Setting the CPU affinity of threads is not supported on this platform\n");
+#endif
+}
+
+void *worker_thread(void *p)
+{
+    struct worker *worker = (struct worker*) p;
+    workerpool_t *wp = worker->wp;
+
+    // before the thread touches any memory, so that its stack (and
+    // what it allocates) is placed on the memory node of its CPUs.
+    if (worker->ncpus > 0)
+        pin_thread(worker->cpus, worker->ncpus);
+
+    uint32_t generation = 0;
+
+    while (1) {
+        // wait for the next run.
+        for (int i = 0; wp_load32(&wp->generation) == generation; i++) {
+            if (i < wp->spin) {
+                wp_pause();
+                continue;
+            }
+
+            pthread_mutex_lock(&wp->mutex);
+            wp->nparked++;
+            while (wp_load32(&wp->generation) == generation)
+                pthread_cond_wait(&wp->startcond, &wp->mutex);
+            wp->nparked--;
+            pthread_mutex_unlock(&wp->mutex);
+        }
+        generation = wp_load32(&wp->generation);
 
         // we've been asked to exit.
-        if (task->f == NULL)
+        if (wp_load32(&wp->exiting))
             return NULL;
 
-        task->f(task->p);
+        struct run *run;
+        while ((run = join_run(wp, worker->id)) != NULL) {
+            run_tasks(run, wp->nthreads, worker->id);
+            leave_run(wp, run);
+        }
     }
 
     return NULL;
 }
 
-workerpool_t *workerpool_create(int nthreads)
+// Increments the generation, waking the workers that went to sleep.
+// Called with the mutex held.
+static void start_workers(workerpool_t *wp)
 {
-    assert(nthreads > 0);
+    wp_fetch_add32(&wp->generation, 1);
+    if (wp->nparked > 0)
+        pthread_cond_broadcast(&wp->startcond);
+}
 
+static workerpool_t *workerpool_create_internal(int nthreads)
+{
     workerpool_t *wp = calloc(1, sizeof(workerpool_t));
     wp->nthreads = nthreads;
     wp->tasks = zarray_create(sizeof(struct task));
-    wp->start_predicate = false;
+    wp->shared = wp;
+
+    if (nthreads > 1)
+        wp->run.deques = calloc(nthreads, sizeof(struct deque));
+
+    return wp;
+}
+
+workerpool_t *workerpool_create(int nthreads)
+{
+    return workerpool_create_pinned(nthreads, NULL, NULL);
+}
+
+workerpool_t *workerpool_create_pinned(int nthreads, const int *ncpus, const int *cpus)
+{
+    assert(nthreads > 0);
+    assert((ncpus == NULL) == (cpus == NULL));
+
+    workerpool_t *wp = workerpool_create_internal(nthreads);
 
     if (nthreads > 1) {
-        wp->threads = calloc(wp->nthreads, sizeof(pthread_t));
+        wp->threads = calloc(wp->nthreads - 1, sizeof(pthread_t));
+        wp->workers = calloc(wp->nthreads, sizeof(struct worker));
+        wp->runs = zarray_create(sizeof(struct run*));
+
+        // spinning only helps if the threads do not have to share
+        // cores.
+        wp->spin = workerpool_get_nprocs() >= nthreads ? WORKERPOOL_SPIN_ITERATIONS : 0;
 
         pthread_mutex_init(&wp->mutex, NULL);
         pthread_cond_init(&wp->startcond, NULL);
         pthread_cond_init(&wp->endcond, NULL);
 
-        for (int i = 0; i < nthreads; i++) {
-            int res = pthread_create(&wp->threads[i], NULL, worker_thread, wp);
+        // the caller of workerpool_run is thread 0.
+        for (int i = 1, pos = 0; i < nthreads; i++) {
+            wp->workers[i].wp = wp;
+            wp->workers[i].id = i;
+            if (ncpus != NULL && ncpus[i - 1] > 0) {
+                wp->workers[i].ncpus = ncpus[i - 1];
+                wp->workers[i].cpus = malloc(ncpus[i - 1] * sizeof(int));
+                memcpy(wp->workers[i].cpus, &cpus[pos], ncpus[i - 1] * sizeof(int));
+                pos += ncpus[i - 1];
+            }
+            int res = pthread_create(&wp->threads[i - 1], NULL, worker_thread, &wp->workers[i]);
             if (res != 0) {
                 debug_print("Insufficient system resources to create workerpool threads\n");
                 // errno already set to EAGAIN by pthread_create() failure
                 return NULL;
             }
         }
-
-        // Wait for the worker threads to be ready
-        pthread_mutex_lock(&wp->mutex);
-        while (wp->end_count < wp->nthreads) {
-            pthread_cond_wait(&wp->endcond, &wp->mutex);
-        }
-        pthread_mutex_unlock(&wp->mutex);
     }
 
     return wp;
 }
 
+workerpool_t *workerpool_create_shared(workerpool_t *shared)
+{
+    assert(shared != NULL);
+
+    workerpool_t *wp = workerpool_create_internal(shared->nthreads);
+    wp->shared = shared->shared;
+
+    return wp;
+}
+
 void workerpool_destroy(workerpool_t *wp)
 {
     if (wp == NULL)
         return;
 
     // force all worker threads to exit.
-    if (wp->nthreads > 1) {
-        for (int i = 0; i < wp->nthreads; i++)
-            workerpool_add_task(wp, NULL, NULL);
-
+    if (wp->threads != NULL) {
         pthread_mutex_lock(&wp->mutex);
-        wp->start_predicate = true;
-        pthread_cond_broadcast(&wp->startcond);
+        wp_store32(&wp->exiting, 1);
+        start_workers(wp);
         pthread_mutex_unlock(&wp->mutex);
 
-        for (int i = 0; i < wp->nthreads; i++)
+        for (int i = 0; i < wp->nthreads - 1; i++)
             pthread_join(wp->threads[i], NULL);
 
         pthread_mutex_destroy(&wp->mutex);
         pthread_cond_destroy(&wp->startcond);
         pthread_cond_destroy(&wp->endcond);
+        for (int i = 1; i < wp->nthreads; i++)
+            free(wp->workers[i].cpus);
         free(wp->threads);
+        free(wp->workers);
+        zarray_destroy(wp->runs);
     }
 
+    free(wp->run.deques);
     zarray_destroy(wp->tasks);
     free(wp);
 }
@@ -167,13 +518,8 @@ void workerpool_add_task(workerpool_t *wp, void (*f)(void *p), void *p)
     t.f = f;
     t.p = p;
 
-    if (wp->nthreads > 1) {
-        pthread_mutex_lock(&wp->mutex);
-        zarray_add(wp->tasks, &t);
-        pthread_mutex_unlock(&wp->mutex);
-    } else {
-        zarray_add(wp->tasks, &t);
-    }
+    // the workers only read the tasks of a run, once it has started.
+    zarray_add(wp->tasks, &t);
 }
 
 void workerpool_run_single(workerpool_t *wp)
@@ -191,19 +537,51 @@ void workerpool_run_single(workerpool_t *wp)
 void workerpool_run(workerpool_t *wp)
 {
     if (wp->nthreads > 1) {
-        pthread_mutex_lock(&wp->mutex);
-        wp->end_count = 0;
-        wp->start_predicate = true;
-        pthread_cond_broadcast(&wp->startcond);
+        int ntasks = zarray_size(wp->tasks);
+        if (ntasks == 0)
+            return;
+
+        workerpool_t *shared = wp->shared;
+        struct run *run = &wp->run;
+
+        // every task is in one thread's range, in order.
+        run->tasks = (struct task*) wp->tasks->data;
+        wp_store32(&run->remaining, ntasks);
+        for (int i = 0; i < wp->nthreads; i++) {
+            uint64_t head = (int64_t) ntasks * i / wp->nthreads;
+            uint64_t tail = (int64_t) ntasks * (i + 1) / wp->nthreads;
+            wp_store64(&run->deques[i].range, head << 32 | tail);
+        }
+
+        pthread_mutex_lock(&shared->mutex);
+        zarray_add(shared->runs, &run);
+        start_workers(shared);
+        pthread_mutex_unlock(&shared->mutex);
 
-        while (wp->end_count < wp->nthreads) {
-//            printf("caught %d\n", wp->end_count);
-            pthread_cond_wait(&wp->endcond, &wp->mutex);
+        run_tasks(run, wp->nthreads, 0);
+
+        // wait for the helpers to finish the tasks they took.
+        for (int i = 0; wp_load32(&run->remaining) != 0 || wp_load32(&run->nhelpers) != 0; i++) {
+            if (i < shared->spin) {
+                wp_pause();
+                continue;
+            }
+
+            pthread_mutex_lock(&shared->mutex);
+            while (wp_load32(&run->remaining) != 0 || wp_load32(&run->nhelpers) != 0)
+                pthread_cond_wait(&shared->endcond, &shared->mutex);
+            pthread_mutex_unlock(&shared->mutex);
         }
 
-        wp->taskspos = 0;
-        wp->start_predicate = false;
-        pthread_mutex_unlock(&wp->mutex);
+        // a worker may have joined the run (under the mutex) after the
+        // loop above saw no helpers, and still be about to read it. Once
+        // the run is removed, none can join it any more, so wait for
+        // those to leave before the run may be reused or freed.
+        pthread_mutex_lock(&shared->mutex);
+        zarray_remove_value(shared->runs, &run, 1);
+        while (wp_load32(&run->nhelpers) != 0)
+            pthread_cond_wait(&shared->endcond, &shared->mutex);
+        pthread_mutex_unlock(&shared->mutex);
 
         zarray_clear(wp->tasks);
 
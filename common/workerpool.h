@@ -31,14 +31,31 @@ either expressed or implied, of the Regents of The University of Michigan.
 
 typedef struct workerpool workerpool_t;
 
-// as a special case, if nthreads==1, no additional threads are
-// created, and workerpool_run will run synchronously.
+// nthreads counts the thread calling workerpool_run, which runs tasks
+// too, so nthreads - 1 helper threads are created. In particular, if
+// nthreads==1, no additional threads are created, and workerpool_run
+// will run synchronously.
 workerpool_t *workerpool_create(int nthreads);
+
+// Same as workerpool_create, but restricts each of the nthreads - 1
+// helper threads to some CPUs: helper i may run on the ncpus[i] CPUs
+// that follow those of helpers 0..i-1 in cpus. (A helper with
+// ncpus[i] == 0 may run on any.) The caller of workerpool_run is not
+// pinned. Both can be NULL, and are copied.
+workerpool_t *workerpool_create_pinned(int nthreads, const int *ncpus, const int *cpus);
+
+// Creates a pool with its own list of tasks, which runs them on the
+// threads of shared (and the caller of workerpool_run). Several such
+// pools can run at the same time, from different threads, without
+// creating more threads. shared must be destroyed after them.
+workerpool_t *workerpool_create_shared(workerpool_t *shared);
 void workerpool_destroy(workerpool_t *wp);
 
 void workerpool_add_task(workerpool_t *wp, void (*f)(void *p), void *p);
 
-// runs all added tasks, waits for them to complete.
+// runs all added tasks, waits for them to complete. The tasks are split
+// among the threads in the order they were added, but idle threads take
+// (steal) the others' remaining ones, so any task may run on any thread.
 void workerpool_run(workerpool_t *wp);
 
 // same as workerpool_run, except always single threaded. (mostly for debugging).
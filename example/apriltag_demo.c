@@ -85,10 +85,17 @@ int main(int argc, char *argv[])
     getopt_add_string(getopt, 'f', "family", "tag36h11", "Tag family to use");
     getopt_add_int(getopt, 'i', "iters", "1", "Repeat processing on input set this many times");
     getopt_add_int(getopt, 't', "threads", "1", "Use this many CPU threads");
+    getopt_add_string(getopt, '\0', "cpus", "", "Pin the threads other than the main one to these CPUs, one each (comma separated)");
     getopt_add_int(getopt, 'a', "hamming", "1", "Detect tags with up to this many bit errors.");
     getopt_add_double(getopt, 'x', "decimate", "2.0", "Decimate input image by this factor");
     getopt_add_double(getopt, 'b', "blur", "0.0", "Apply low-pass blur to input; negative sharpens");
     getopt_add_bool(getopt, '0', "refine-edges", 1, "Spend more time trying to align edges of tags");
+    getopt_add_int(getopt, '\0', "tile-size", "4", "Size of the thresholding tiles in pixels");
+    getopt_add_bool(getopt, '\0', "local-mean", 0, "Threshold against the local mean instead of tile min/max");
+    getopt_add_bool(getopt, '\0', "aggregate-points", 0, "Combine the boundary points each pixel adds to a cluster");
+    getopt_add_double(getopt, '\0', "cluster-max-aspect", "0", "Reject clusters with a more elongated bounding box (0 = off)");
+    getopt_add_double(getopt, '\0', "cluster-min-direction", "0", "Reject clusters with fewer gradients facing some direction (0 = off)");
+    getopt_add_double(getopt, '\0', "cluster-max-density", "0", "Reject clusters with more points per perimeter pixel (0 = off)");
 
     if (!getopt_parse(getopt, argc, argv, 1) || getopt_get_bool(getopt, "help")) {
         printf("Usage: %s [options] <input files>\n", argv[0]);
@@ -156,6 +163,7 @@ int main(int argc, char *argv[])
     }
 
     apriltag_detector_t *td = apriltag_detector_create();
+    errno = 0;
     apriltag_detector_add_family_bits(td, tf, getopt_get_int(getopt, "hamming"));
 
     switch(errno){
@@ -163,7 +171,7 @@ int main(int argc, char *argv[])
             printf("\"hamming\" parameter is out-of-range.\n");
             exit(-1);
         case ENOMEM:
-            printf("Unable to add family to detector due to insufficient memory to allocate the tag-family decoder. Try reducing \"hamming\" from %d or choose an alternative tag family.\n", getopt_get_int(getopt, "hamming"));
+            printf("Unable to add family to detector due to insufficient memory to allocate the tag-family decoder. Choose an alternative tag family.\n");
             exit(-1);
     }
 
@@ -172,6 +180,27 @@ int main(int argc, char *argv[])
     td->nthreads = getopt_get_int(getopt, "threads");
     td->debug = getopt_get_bool(getopt, "debug");
     td->refine_edges = getopt_get_bool(getopt, "refine-edges");
+    td->qtp.threshold_tile_size = getopt_get_int(getopt, "tile-size");
+    td->qtp.threshold_local_mean = getopt_get_bool(getopt, "local-mean");
+    td->qtp.aggregate_points = getopt_get_bool(getopt, "aggregate-points");
+    td->qtp.cluster_max_aspect = getopt_get_double(getopt, "cluster-max-aspect");
+    td->qtp.cluster_min_direction = getopt_get_double(getopt, "cluster-min-direction");
+    td->qtp.cluster_max_density = getopt_get_double(getopt, "cluster-max-density");
+
+    int *thread_ncpus = NULL, *thread_cpus = NULL;
+    const char *cpus = getopt_get_string(getopt, "cpus");
+    if (cpus[0] != '\0' && td->nthreads > 1) {
+        thread_ncpus = calloc(td->nthreads - 1, sizeof(int));
+        thread_cpus = calloc(td->nthreads - 1, sizeof(int));
+        for (int i = 0; i < td->nthreads - 1 && *cpus != '\0'; i++) {
+            char *end;
+            thread_cpus[i] = strtol(cpus, &end, 10);
+            thread_ncpus[i] = 1;
+            cpus = *end == ',' ? end + 1 : end;
+        }
+        td->thread_ncpus = thread_ncpus;
+        td->thread_cpus = thread_cpus;
+    }
 
     int quiet = getopt_get_bool(getopt, "quiet");
 
@@ -310,6 +339,8 @@ int main(int argc, char *argv[])
 
     // don't deallocate contents of inputs; those are the argv
     apriltag_detector_destroy(td);
+    free(thread_ncpus);
+    free(thread_cpus);
 
     if (!strcmp(famname, "tag36h11")) {
         tag36h11_destroy(tf);
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <string.h>
+#include <apriltag.h>
+#include <tag36h11.h>
+#include <common/pjpeg.h>
+
+// Detects the same images with several numbers of threads, and checks
+// that the detections, and their order, do not depend on it. The
+// sizes of the tasks follow how long they took, so each detector runs
+// a few times.
+
+#define NREPEATS 3
+
+static const int nthreads[] = { 2, 3, 4, 6, 8 };
+
+static apriltag_detector_t *create_detector(apriltag_family_t *tf, int n, float decimate)
+{
+    apriltag_detector_t *td = apriltag_detector_create();
+    td->nthreads = n;
+    td->quad_decimate = decimate;
+    apriltag_detector_add_family(td, tf);
+    return td;
+}
+
+static bool detections_equal(zarray_t *a, zarray_t *b)
+{
+    if (zarray_size(a) != zarray_size(b))
+        return false;
+
+    for (int i = 0; i < zarray_size(a); i++) {
+        apriltag_detection_t *da, *db;
+        zarray_get(a, i, &da);
+        zarray_get(b, i, &db);
+        if (da->id != db->id || da->hamming != db->hamming ||
+            da->decision_margin != db->decision_margin ||
+            memcmp(da->c, db->c, sizeof(da->c)) != 0 ||
+            memcmp(da->p, db->p, sizeof(da->p)) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    apriltag_family_t *tf = tag36h11_create();
+    bool ok = true;
+
+    for (int i = 1; i < argc; i++) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s.jpg", argv[i]);
+        pjpeg_t *pjpeg = pjpeg_create_from_file(path, 0, NULL);
+        if (pjpeg == NULL) {
+            printf("Cannot load %s\n", path);
+            return EXIT_FAILURE;
+        }
+        image_u8_t *im = pjpeg_to_u8_baseline(pjpeg);
+
+        for (float decimate = 1; decimate <= 2; decimate++) {
+            apriltag_detector_t *td = create_detector(tf, 1, decimate);
+            zarray_t *expected = apriltag_detector_detect(td, im);
+            apriltag_detector_destroy(td);
+
+            for (int j = 0; j < (int) (sizeof(nthreads) / sizeof(nthreads[0])); j++) {
+                td = create_detector(tf, nthreads[j], decimate);
+                for (int k = 0; k < NREPEATS; k++) {
+                    zarray_t *detections = apriltag_detector_detect(td, im);
+                    if (!detections_equal(detections, expected)) {
+                        printf("%s, decimate %g: the detections differ with %d threads\n",
+                               argv[i], decimate, nthreads[j]);
+                        ok = false;
+                    }
+                    apriltag_detections_destroy(detections);
+                }
+                apriltag_detector_destroy(td);
+            }
+
+            apriltag_detections_destroy(expected);
+        }
+
+        image_u8_destroy(im);
+        pjpeg_destroy(pjpeg);
+    }
+
+    tag36h11_destroy(tf);
+
+    if (!ok)
+        return EXIT_FAILURE;
+
+    printf("Detections do not depend on the number of threads\n");
+    return EXIT_SUCCESS;
+}
@@ -32,6 +32,9 @@
 
 #include "../apriltag.c"
 
+// The file the tables are written to; given by ctest in its build tree.
+static const char *tables_path = "test_quick_decode_tables.bin";
+
 void test_family(apriltag_family_t *fam) {
     printf("Testing family %s with %d codes, %d bits\n", fam->name, fam->ncodes, fam->nbits);
     
@@ -45,13 +48,15 @@ void test_family(apriltag_family_t *fam) {
     apriltag_detector_add_family_bits(td, fam, limit);
     
     // Validate initialization
-    struct quick_decode *qd = (struct quick_decode*) fam->impl;
-    if (!qd) {
+    const struct quick_decode_tables *qt = quick_decode_get_tables(fam);
+    if (!qt) {
         printf("Failed to init quick_decode for %s\n", fam->name);
         exit(1);
     }
     
-    if (qd->maxhamming != limit) {
+    int maxhamming;
+    zarray_get(td->tag_family_bits, 0, &maxhamming);
+    if (maxhamming != limit) {
         printf("Failed to set maxhamming to %d for %s\n", limit, fam->name);
         exit(1);
     }
@@ -63,7 +68,7 @@ void test_family(apriltag_family_t *fam) {
         
         // Test 0 errors
         struct quick_decode_result res;
-        quick_decode_codeword(fam, code, &res);
+        quick_decode_codeword(fam, qt, limit, code, &res);
         if (res.id != i || res.hamming != 0) {
             printf("Failed 0 errors: code %u, got id %d hamming %d\n", i, res.id, res.hamming);
             exit(1);
@@ -74,7 +79,7 @@ void test_family(apriltag_family_t *fam) {
         // Test 1 bit error
         for (int b1 = 0; b1 < nbits; b1++) {
             uint64_t c1 = code ^ (1ULL << b1);
-            quick_decode_codeword(fam, c1, &res);
+            quick_decode_codeword(fam, qt, limit, c1, &res);
              if (res.id != i || res.hamming != 1) {
                 printf("Failed 1 error: code %u bit %d, got id %d hamming %d\n", i, b1, res.id, res.hamming);
                 exit(1);
@@ -85,7 +90,7 @@ void test_family(apriltag_family_t *fam) {
             // Test 2 bit errors
             for (int b2 = b1 + 1; b2 < nbits; b2++) {
                 uint64_t c2 = c1 ^ (1ULL << b2);
-                quick_decode_codeword(fam, c2, &res);
+                quick_decode_codeword(fam, qt, limit, c2, &res);
                 if (res.id != i || res.hamming != 2) {
                     printf("Failed 2 errors: code %u bits %d,%d, got id %d hamming %d\n", i, b1, b2, res.id, res.hamming);
                     exit(1);
@@ -96,7 +101,7 @@ void test_family(apriltag_family_t *fam) {
                 // Test 3 bit errors
                 for (int b3 = b2 + 1; b3 < nbits; b3++) {
                     uint64_t c3 = c2 ^ (1ULL << b3);
-                    quick_decode_codeword(fam, c3, &res);
+                    quick_decode_codeword(fam, qt, limit, c3, &res);
                     if (res.id != i || res.hamming != 3) {
                         printf("Failed 3 errors: code %u bits %d,%d,%d, got id %d hamming %d\n", i, b1, b2, b3, res.id, res.hamming);
                         exit(1);
@@ -106,11 +111,42 @@ void test_family(apriltag_family_t *fam) {
         }
     }
     
+    // The tables mapped from a file must be the ones built above.
+    if (apriltag_family_write_decode_tables(fam, tables_path) != 0) {
+        printf("Failed to write the tables of %s\n", fam->name);
+        exit(1);
+    }
+    size_t size = qt->size;
+    void *data = malloc(size);
+    memcpy(data, qt->data, size);
+
     apriltag_detector_destroy(td);
+    if (fam->impl) {
+        printf("Failed to release the tables of %s\n", fam->name);
+        exit(1);
+    }
+
+    td = apriltag_detector_create();
+    if (apriltag_detector_add_family_mapped(td, fam, limit, tables_path) != 0) {
+        printf("Failed to map the tables of %s\n", fam->name);
+        exit(1);
+    }
+    qt = quick_decode_get_tables(fam);
+    if (!qt->fm || qt->size != size || memcmp(qt->data, data, size) != 0) {
+        printf("Mapped tables of %s differ\n", fam->name);
+        exit(1);
+    }
+
+    free(data);
+    apriltag_detector_destroy(td);
+    remove(tables_path);
     printf("Family %s passed.\n", fam->name);
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+    if (argc > 1)
+        tables_path = argv[1];
+
     apriltag_family_t *fams[] = {
         tag16h5_create(),
         tag25h9_create(),
@@ -145,6 +181,23 @@ int main() {
         test_family(fams[i]);
     }
 
+    // Tables of another family are not mapped, but built when needed.
+    apriltag_family_write_decode_tables(fams[12], tables_path);
+    apriltag_detector_t *td = apriltag_detector_create();
+    if (apriltag_detector_add_family_mapped(td, fams[11], 1, tables_path) == 0) {
+        printf("Mapped the tables of %s for %s\n", fams[12]->name, fams[11]->name);
+        exit(1);
+    }
+    const struct quick_decode_tables *qt = quick_decode_get_tables(fams[11]);
+    struct quick_decode_result res;
+    quick_decode_codeword(fams[11], qt, 1, fams[11]->codes[7], &res);
+    if (!qt || qt->fm || res.id != 7) {
+        printf("Failed to build the tables of %s\n", fams[11]->name);
+        exit(1);
+    }
+    apriltag_detector_destroy(td);
+    remove(tables_path);
+
     tag16h5_destroy(fams[0]);
     tag25h9_destroy(fams[1]);
     tag36h10_destroy(fams[2]);
@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <string.h>
+#include <apriltag.h>
+#include <tag36h11.h>
+#include <common/pjpeg.h>
+#include <common/pthreads_cross.h>
+
+// Runs one detector per image, all sharing one workerpool, in threads
+// of their own, and checks that they find what a detector with its own
+// workerpool of the same size does. Meanwhile, another thread keeps
+// creating, using and destroying detectors attached to the same pool.
+
+#define NTHREADS 3
+#define NREPEATS 4
+#define NCHURNS 20
+
+struct camera
+{
+    image_u8_t *im;
+    apriltag_detector_t *td;
+    zarray_t *expected;
+    bool ok;
+};
+
+static apriltag_detector_t *create_detector(apriltag_family_t *tf)
+{
+    apriltag_detector_t *td = apriltag_detector_create();
+    td->quad_decimate = 1;
+    td->refine_edges = false;
+    apriltag_detector_add_family(td, tf);
+    return td;
+}
+
+static bool detections_equal(zarray_t *a, zarray_t *b)
+{
+    if (zarray_size(a) != zarray_size(b))
+        return false;
+
+    for (int i = 0; i < zarray_size(a); i++) {
+        apriltag_detection_t *da, *db;
+        zarray_get(a, i, &da);
+        zarray_get(b, i, &db);
+        if (da->id != db->id || da->hamming != db->hamming ||
+            memcmp(da->p, db->p, sizeof(da->p)) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+static void *camera_thread(void *p)
+{
+    struct camera *camera = p;
+
+    camera->ok = true;
+    for (int i = 0; i < NREPEATS; i++) {
+        zarray_t *detections = apriltag_detector_detect(camera->td, camera->im);
+        if (!detections_equal(detections, camera->expected))
+            camera->ok = false;
+        apriltag_detections_destroy(detections);
+    }
+
+    return NULL;
+}
+
+struct churn
+{
+    apriltag_family_t *tf;
+    workerpool_t *wp;
+    image_u8_t *im;
+};
+
+static void *churn_thread(void *p)
+{
+    struct churn *churn = p;
+
+    for (int i = 0; i < NCHURNS; i++) {
+        apriltag_detector_t *td = create_detector(churn->tf);
+        apriltag_detector_set_workerpool(td, churn->wp);
+        apriltag_detections_destroy(apriltag_detector_detect(td, churn->im));
+        apriltag_detector_destroy(td);
+    }
+
+    return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        return EXIT_FAILURE;
+    }
+
+    int ncameras = argc - 1;
+    struct camera *cameras = calloc(ncameras, sizeof(struct camera));
+    apriltag_family_t *tf = tag36h11_create();
+
+    apriltag_detector_t *td = create_detector(tf);
+    td->nthreads = NTHREADS;
+
+    workerpool_t *wp = workerpool_create(NTHREADS);
+
+    for (int i = 0; i < ncameras; i++) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s.jpg", argv[i + 1]);
+        pjpeg_t *pjpeg = pjpeg_create_from_file(path, 0, NULL);
+        if (pjpeg == NULL) {
+            return EXIT_FAILURE;
+        }
+        cameras[i].im = pjpeg_to_u8_baseline(pjpeg);
+        pjpeg_destroy(pjpeg);
+
+        cameras[i].expected = apriltag_detector_detect(td, cameras[i].im);
+
+        cameras[i].td = create_detector(tf);
+        apriltag_detector_set_workerpool(cameras[i].td, wp);
+    }
+
+    pthread_t *threads = calloc(ncameras, sizeof(pthread_t));
+    for (int i = 0; i < ncameras; i++) {
+        pthread_create(&threads[i], NULL, camera_thread, &cameras[i]);
+    }
+
+    struct churn churn = { tf, wp, cameras[0].im };
+    pthread_t churn_thread_id;
+    pthread_create(&churn_thread_id, NULL, churn_thread, &churn);
+
+    bool ok = true;
+    for (int i = 0; i < ncameras; i++) {
+        pthread_join(threads[i], NULL);
+        if (!cameras[i].ok) {
+            fprintf(stderr, "Mismatch for %s.\n", argv[i + 1]);
+            ok = false;
+        }
+    }
+    pthread_join(churn_thread_id, NULL);
+
+    for (int i = 0; i < ncameras; i++) {
+        apriltag_detector_destroy(cameras[i].td);
+        apriltag_detections_destroy(cameras[i].expected);
+        image_u8_destroy(cameras[i].im);
+    }
+    free(threads);
+    free(cameras);
+
+    workerpool_destroy(wp);
+    apriltag_detector_destroy(td);
+    tag36h11_destroy(tf);
+
+    if (!ok) {
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}